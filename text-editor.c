@@ -1,3 +1,7 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <termios.h>
 #include <stdio.h>
@@ -10,15 +14,32 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
-
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <regex.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f) // This macro takes in a letter and gets the value for CTRL+<letter>
 #define TEXT_EDITOR_VERSION "1.0.0"
 #define TAB_STOPS 8
+#define RX_CHECKPOINT_STEP 256 // Bytes between saved cx/rx/render positions on rows with tabs or UTF-8
+#define BRACKET_BLOCK_ROWS 128 // Rows per leaf of the bracket index, a leaf that changed is summed up again row by row
 #define QUIT_TIMES 3
 #define RED 31
 #define GREEN 32
@@ -27,6 +48,35 @@
 #define MAGENTA 35
 #define CYAN 36
 #define WHITE 37
+#define BRIGHT_RED 91
+#define JOURNAL_MAGIC "TEJ1"
+#define JOURNAL_FLUSH_MS 200 // Group commit window, records typed within it share a single write + fdatasync
+#define JOURNAL_COMPACT_MIN (1 << 20) // Never compact a journal smaller than this
+#define FOLLOW_POLL_MS 500 // How often follow mode stats the file when inotify is unavailable
+#define FOLLOW_READ_CHUNK (64 * 1024)
+#define LOADER_READ_CHUNK (64 * 1024)
+#define LOADER_BATCH (256 * 1024) // Hand rows to the main thread in batches of about this many bytes
+#define LOADER_DRAIN_MAX (8 * 1024 * 1024) // Most bytes turned into rows per drain, so keys still get handled
+#define WORDS_MIN_LEN 2 // Shorter words aren't worth completing
+#define WORDS_MAX_LEN 64 // Longer runs are data, not identifiers
+#define WORDS_ARENA_SIZE (1 << 20)
+#define WORDS_PUBLISH_MS 100 // How stale the completion list may get while a big file is still being indexed
+#define WORDS_BULK_SLICE (1 << 20) // Bytes of a cache-loaded file counted per turn, so dropping it never waits long
+#define COMPLETE_MAX 64
+#define LINES_MAX_THREADS 16
+#define LINES_MIN_PER_THREAD 65536 // Below this a thread costs more than it saves
+#define SAVE_BUFFER_SIZE (1 << 20) // Edited rows are gathered up to this much before being written
+#define GZIP_BLOCK_SIZE (1 << 20) // Compressed on its own thread, primed with the 32K before it so little ratio is lost
+#define GZIP_WINDOW 32768
+#define KEY_QUEUE_SIZE 256 // Keys decoded ahead of the core, a paste bigger than this waits in the tty buffer
+#define HEX_LINE_BYTES 16
+#define HEX_SNIFF_SIZE 8192 // A NUL in this much of the start of a file makes it binary
+#define HEX_SEARCH_WINDOW (64LL << 20)
+#define CACHE_MAGIC "TELC"
+#define CACHE_VERSION 2
+#define CACHE_MIN_SIZE (1 << 20) // Smaller files load fast enough on their own, don't litter the cache with them
+#define CACHE_SAMPLE_SIZE (64 * 1024) // Bytes hashed at each sample point of the content hash
+#define CACHE_SAMPLES 16
 
 enum editorKey {
     BACKSPACE = 127,
@@ -41,6 +91,22 @@ enum editorKey {
     PAGE_DOWN
 };
 
+enum journalOp {
+    JOURNAL_INSERT_CHAR = 'i',
+    JOURNAL_DELETE_CHAR = 'd',
+    JOURNAL_APPEND_STRING = 'a',
+    JOURNAL_INSERT_ROW = 'r',
+    JOURNAL_DELETE_ROW = 'x',
+    JOURNAL_TRUNCATE_ROW = 't',
+    JOURNAL_SNAPSHOT = 'S'
+};
+
+enum editorCompression {
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP, // Through zlib
+    COMPRESS_ZSTD // Through the zstd command, there is no libzstd to link against everywhere
+};
+
 enum editorHighlight {
     HL_NORMAL = 0,
     HL_COMMENT,
@@ -49,7 +115,8 @@ enum editorHighlight {
     HL_KEYWORD2,
     HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_BRACKET
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
@@ -66,6 +133,17 @@ struct editorSyntax{
     int flags;
 };
 
+typedef struct rowCheckpoint{
+    int cx; // Offset into chars, always at the start of a char
+    int rx; // Screen column that char is drawn at
+    int rbyte; // Offset into render
+} rowCheckpoint;
+
+struct wrapPoint{
+    int rbyte; // Offset into render
+    int rx;
+};
+
 typedef struct erow{
     int idx;
     int size;
@@ -74,16 +152,239 @@ typedef struct erow{
     char *chars;
     unsigned char *hl;
     int hlOpenComment;
+    int tabs; // Number of tabs in chars
+    int ascii; // No bytes >= 0x80, together with no tabs this means cx, rx and render offsets are all the same
+    rowCheckpoint *checkpoints; // A position every RX_CHECKPOINT_STEP bytes, built on first use and dropped whenever the row changes
+    int numCheckpoints;
+    int brClose; // Closing brackets in code (not strings or comments) with no opener earlier on the row
+    int brOpen; // Opening brackets in code still open at the end of the row, -1 until the bracket index asks
+    int savedLen; // What the row adds to the saved file (size + 1 for the newline), as counted in E.offsets
+    long long origOff; // Where the row's chars and '\n' sit unchanged in E.saveSource, -1 once edited
+    int wrapWidth; // Screen width wrapCount and wrapStarts were worked out for, 0 once the row changes
+    int wrapCount; // Screen lines the row takes up when soft wrapping
+    struct wrapPoint *wrapStarts; // Where each of those lines starts, NULL for ASCII rows that break every wrapWidth bytes
+    int mapped; // chars points into E.loadBuf rather than its own '\0' terminated copy
 } erow;
 
+struct journalHeader{
+    char magic[4];
+    uint32_t recordSize; // Size of a record header, guards against reading a journal from another build
+    int64_t baseSize; // Size and mtime of the file on disk the journaled edits apply on top of
+    int64_t baseMtime;
+};
+
+struct editorJournal{
+    char *path; // Journal next to the edited file: dir/.name.tej, a name of its own so vim's .name.swp is left alone
+    int fd; // Only touched by the writer thread
+    pthread_t writer;
+    pthread_mutex_t lock; // Guards everything below, never held across disk I/O
+    pthread_cond_t cond;
+    char *pending; // Encoded records waiting for the writer thread
+    size_t pendingLen;
+    size_t pendingCap;
+    int compact; // Set when the writer should start a fresh journal from header (+ snapshot)
+    struct journalHeader header;
+    char *snapshot; // Whole buffer contents for a compaction that couldn't fork a snapshotChild, else NULL
+    size_t snapshotLen;
+    pid_t snapshotChild; // Process writing the snapshot for a compaction into snapshotPath, 0 if none
+    char *snapshotPath;
+    int snapshots; // Forked so far, numbers their temp files (main thread only)
+    int stop;
+    size_t sinceCompact; // Bytes journaled since the last compaction (main thread only)
+    size_t compactAt; // Compact once sinceCompact grows past this (main thread only)
+    int muted; // Don't journal what changes the buffer now: edits being replayed, rows follow mode reads into a clean buffer (main thread only)
+    int stale; // Follow mode grew the file past the header's stamp, it is stamped again before the next edit (main thread only)
+    int fromSnapshot; // The journal starts with a snapshot, not the file on disk (main thread only)
+};
+
+struct editorFollow{
+    int fd; // Open handle on the file being followed, survives renames so rotated logs get drained
+    int inotifyFd; // -1 when inotify is unavailable and we fall back to polling
+    int watch;
+    off_t offset; // Everything before this has already been turned into rows
+    int partial; // The last row is a line that hasn't seen its newline yet
+    int rotated; // The file was moved or deleted, reopen the path as soon as something is there again
+    struct timespec lastPoll;
+};
+
+struct loaderBatch{
+    char *buf; // Whole lines, only the very last batch may end without a newline
+    int len;
+    struct loaderBatch *next;
+};
+
+struct editorLoader{
+    int fd; // Pipe or file the rows are streamed from
+    z_stream *gz; // Set when fd is gzip, the reader inflates it as it goes
+    unsigned char *gzIn;
+    int gzEnded; // The last gzip member was complete, so running out of input here is a clean end
+    pid_t child; // zstd -d process writing into fd, 0 if none
+    int journal; // Open the swap file (and offer recovery) once everything is loaded
+    pthread_t reader;
+    int threaded; // reader is running, 0 when the stream was read to the end in place (batch mode)
+    pthread_mutex_t lock; // Guards the batch queue and the counters below
+    struct loaderBatch *head;
+    struct loaderBatch *tail;
+    long long bytesRead;
+    int done;
+    int error;
+    long long bytesLoaded; // Bytes turned into rows so far (main thread only)
+};
+
+struct lineCacheHeader{
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize; // Size, mtime, inode and a sampled content hash of the file the index describes
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t inode;
+    uint64_t hash;
+    uint64_t numRows;
+    char fileType[16]; // Syntax the hlOpenComment bits were computed with
+    int32_t cy, cx, rowOffset, colOffset; // Where the user left off
+    uint32_t pathLen; // Followed by the path, uint32 length of every line (with its line ending), the hlOpenComment
+                      // bitset and a bitset of the lines that end in just '\n'
+    uint32_t reserved;
+};
+
+// Identifier index for completion. Rows hand over the text they gained and lost, a worker thread keeps
+// an interned, reference counted table of the words and publishes a sorted list of the live ones
+struct wordEntry{
+    uint32_t hash;
+    int len;
+    int count; // Occurrences in the buffer (worker thread only)
+    int listed; // In the published list or waiting to be merged into it (worker thread only)
+    char word[]; // NUL terminated, never moves or changes once interned
+};
+
+struct wordArena{
+    struct wordArena *next;
+    size_t used;
+    char data[];
+};
+
+struct editorWords{
+    pthread_t worker;
+    pthread_mutex_t lock; // Guards the queued text and the published list, never held while words are counted
+    pthread_cond_t cond;
+    char *added; // Text of rows that changed, queued for the worker, rows separated by \n
+    size_t addedLen;
+    size_t addedCap;
+    char *removed;
+    size_t removedLen;
+    size_t removedCap;
+    const char *bulk; // What a cache load read in and the worker hasn't counted yet, counted in place out of E.loadBuf
+    size_t bulkLen;
+    int bulkBusy; // The worker is counting a slice it took off the front of bulk
+    int bulkDropped; // The buffer is being freed, what is left of bulk never gets counted
+    int stop;
+    struct wordEntry **sorted; // Published list of live words in strcmp order
+    int numSorted;
+    // Only touched by the worker thread
+    struct wordEntry **table; // Open addressing hash table of every word ever seen
+    size_t tableCap;
+    size_t tableUsed;
+    struct wordArena *arena;
+    struct wordEntry **fresh; // Words that came alive since the last publish, not yet in the list
+    int numFresh;
+    int freshCap;
+    int died; // Listed words whose count dropped to zero since the last publish
+};
+
+// Fenwick tree of the rows' savedLen, so converting between line numbers and byte offsets in the
+// saved file is O(log n). Appending a row is O(log n) too, inserting or deleting anywhere else marks
+// the tree for a rebuild on the next lookup
+struct lineOffsets{
+    long long *tree; // 1-based, tree[i] sums the rows (i - lowbit(i), i]
+    int numRows; // Rows covered by tree
+    int cap;
+    int dirty;
+    long long totalBytes; // Always up to date, even while the tree is dirty
+};
+
+// Read-only view of a binary file, mapped rather than read so only the pages on screen are ever loaded
+struct editorHex{
+    int fd;
+    const unsigned char *map;
+    long long size;
+    long long offset; // First byte on screen, a multiple of HEX_LINE_BYTES
+    long long cursor;
+    char *lastSearch; // Bytes of the last search, so an empty search repeats it
+    int lastSearchLen;
+};
+
+// Keys decoded by the input thread for the core. One producer and one consumer, so each index is only
+// ever written by one side and the ring needs no lock
+struct keyQueue{
+    int keys[KEY_QUEUE_SIZE];
+    unsigned head __attribute__((aligned(64))); // Next key to take, written by the core
+    unsigned tail __attribute__((aligned(64))); // Next free slot, written by the input thread
+    int wakeFd; // eventfd bumped after every push so the core can sleep in poll() between keys
+    int fd; // The terminal
+    int err; // errno of a failed read, passed on with a -1 key
+    pthread_t thread;
+};
+
+// Segment tree over blocks of rows. A node holds the brackets left unmatched across all of its rows, and how
+// many rows that is, so rows can come and go inside a block without renumbering the rest of the tree.
+// Sums are only worked out for the nodes a lookup passes over whole, a node that changed is just marked
+struct bracketIndex{
+    int size; // Number of leaves, a power of two
+    int numBlocks; // Leaves in use, the ones after them are kept empty for rows appended at the end
+    int *close;
+    int *open;
+    int *rows;
+    unsigned char *known; // close and open are up to date. Never set on a node whose children aren't
+    int dirty; // The blocks need cutting up again (line commands, a block grown too big) before the next lookup
+};
+
+// Folded rows, as disjoint ranges sorted by row. Each fold has a visible header row just before it, so folds
+// never touch, and hiddenBefore is how many rows the folds before it hide. Row <-> visible line
+// conversions are then a binary search
+struct fold{
+    int start;
+    int end; // Last hidden row
+    int hiddenBefore;
+};
+
+struct foldIndex{
+    struct fold *folds;
+    int numFolds;
+    int cap;
+    int hidden; // Rows hidden by all the folds
+    int gap; // Folds from here on are still to be moved by shift rows, and their hiddenBefore by hiddenShift
+    int shift;
+    int hiddenShift;
+};
+
+// What Ctrl-N / Ctrl-P keep between presses
+struct editorCompletion{
+    const char *candidates[COMPLETE_MAX];
+    int numCandidates;
+    int current; // -1 while showing just what was typed
+    int prefixLen;
+    int cy; // Row the candidates were looked up for
+};
+
+// What the search prompt keeps between keys
+struct editorSearch{
+    int lastMatch; // Row of the match on screen, -1 before the first one
+    int direction;
+    int savedHlLine;
+    int savedHlLen; // The row can grow or go away while the prompt is open (follow mode), so only this much is put back
+    unsigned char *savedHl; // Highlighting the match covered up, put back on the next key
+};
+
 struct editorConfig{
     struct termios orig_termios; // Global Variable to store teh original terminal settings
+    int ttyFd; // Where keys are read from, /dev/tty when the file itself is coming in on stdin
     int screenRows; // Global Variable for Screen Rows
     int screenCols; // Global Variable for Screen Cols
     int cx, cy; // Global variables to keep track of the cursors position
     int rx; // Keeps track of all the invisible things renders like tabs, so if there is a tab on a line we know not to allow the cursor to go into the tab
     int numRows; // Number of rows
     erow *row; // An array of all the rows
+    int rowCap; // Number of rows there is room for in row
     int rowOffset;
     int colOffset;
     int dirty; // Keeps track of if the files has been changed and not saved
@@ -91,8 +392,42 @@ struct editorConfig{
     char statusMsg[80]; // Message displayed at the bottom of the screen
     time_t statusMsgTime;
     struct editorSyntax *syntax;
+    struct editorJournal *journal; // Crash recovery swap file, NULL when there is none
+    struct editorFollow *follow; // tail -f state, NULL when not following
+    off_t loadedBytes; // How much of the file the rows were read from
+    int loadedPartial; // The file didn't end with a newline
+    struct editorLoader *loader; // Background read of stdin/a pipe, NULL once everything is loaded
+    int loadError; // errno that stopped the last background read part way, 0 if it got everything
+    uint32_t *lineLens; // Raw length of every line as loaded, for writing the line index cache
+    int numLineLens;
+    char *loadBuf; // The file as read in by a line index cache load, mapped rows' chars point into it
+    size_t loadBufLen;
+    int headless; // Batch mode, no terminal, no prompts and no swap file
+    struct bracketIndex *brackets; // Built the first time a bracket is matched
+    struct editorWords *words; // NULL in batch mode
+    struct editorHex *hex; // Set while the file is shown as a hex dump instead of rows
+    int forceText; // Open the next file as text even if it looks binary
+    struct lineOffsets offsets;
+    struct foldIndex folds;
+    int softWrap; // Long rows continue on the next screen lines instead of scrolling sideways
+    int wrapOffset; // Screen line of the row at rowOffset that the screen starts on, when soft wrapping
+    int saveSource; // The file as opened (or last saved), unchanged rows are copied from it on save. -1 if none
+    struct stat saveSourceStat;
+    int compression; // editorCompression of the file, saving compresses it the same way again
+    struct keyQueue *input; // NULL until the input thread runs, keys are read straight from ttyFd until then
+    struct editorRender *render; // NULL until the render thread runs, frames are written by the core until then
+    struct editorCompletion completion;
+    struct editorSearch search;
+    int quitTimes; // Ctrl-Q presses still needed to quit with unsaved changes
+    int completing; // The last key was Ctrl-N or Ctrl-P, another one moves on to the next candidate
+    int noCopyFileRange; // copy_file_range can't be used for this file, saves go straight to sendfile
 };
-struct editorConfig E;
+
+// Every editor function works on the buffer E. It used to be one global, now each thread points at
+// its own editorConfig so batch mode can run one buffer per worker thread. Anything kept from one call
+// to the next belongs in E too, a function-local static would be shared by all the workers
+static __thread struct editorConfig *currentEditor;
+#define E (*currentEditor)
 
 /*** File Types ***/
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -138,30 +473,61 @@ struct editorSyntax HLDB[] = {
 
 
 /*** prototypes ***/
+int editorLoaderBusy();
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void(*callback)(char *, int));
+int editorReadKey();
+int editorIdle();
+static int journalWriteAll(int fd, const char *buf, size_t len);
+static int journalReadAll(int fd, char *buf, size_t len);
+void editorJournalRecord(char op, int a, int b, const char *s, size_t len);
+void editorBracketRowChanged(erow *row);
+void editorFoldRowInserted(int at);
+void editorFoldRowDeleted(int at);
+void editorBracketRowInserted(int at);
+void editorBracketRowDeleted(int at);
+void editorSnapCursor();
+void editorWordsRowChanged(const char *old, int oldLen, const char *new, int newLen);
+void editorWordsAddBulk(const char *text, size_t len);
+void editorWordsDropBulk();
+int editorWordsClaim(char *chars, int len);
+void editorJournalCompact(int withSnapshot);
+void editorJournalOpen(int recover);
+void editorJournalClose(int discard);
+int editorHexOpen(const char *filename, int force);
+void editorSaveSourceSet(int fd);
+void editorRowSetOrigin(erow *row, long long off, const char *raw, int rawLen);
+void editorRowLoad(erow *row);
+void editorFreeBuffer();
+int editorOpenCompressed(const char *filename);
+void editorRenderStop();
+void editorFollowStop();
 
 /*** terminal ***/
 void die(const char *s){
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    if(!currentEditor || !E.headless){
+        editorRenderStop(); // Don't let a frame still being written land after the clear
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+    }
 
     perror(s);
     exit(1);
 }
 
 void disableRawMode() {
+    editorRenderStop();
     write(STDOUT_FILENO, "\x1b[2J", 4); // Clear the screen
     write(STDOUT_FILENO, "\x1b[H", 3); // Reposition the cursor to the top right
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+    if (tcsetattr(E.ttyFd, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 
     write(STDOUT_FILENO, "\033[?1049l", 8); // Exit alternate screen buffer
 }
 
 void enableRawMode() {
-    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");    // Get the original Terminal settings and store them
+    if (tcgetattr(E.ttyFd, &E.orig_termios) == -1) die("tcgetattr");    // Get the original Terminal settings and store them
     atexit(disableRawMode);
     struct termios raw = E.orig_termios;
     raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
@@ -171,25 +537,20 @@ void enableRawMode() {
     raw.c_cc[VMIN] = 0; // This makes it so the read function will return after everysingle byte inputted
     raw.c_cc[VTIME] = 1; // This makes it so the read function will return after 100 milliseconds if there is not byte inputted
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+    if (tcsetattr(E.ttyFd, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 
     write(STDOUT_FILENO, "\033[?1049h", 8); // Enter alternate screen buffer
 }
 
-int editorReadKey() {
-    int nread; // Number of bytes read 
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-      if (nread == -1 && errno != EAGAIN) die("read");
-    }
-
+// Turns the byte c and whatever escape sequence follows it on fd into a key
+static int editorDecodeKey(int fd, char c){
     if(c == '\x1b'){
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (read(fd, &seq[0], 1) != 1) return '\x1b';
+        if (read(fd, &seq[1], 1) != 1) return '\x1b';
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-              if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+              if (read(fd, &seq[2], 1) != 1) return '\x1b';
               if (seq[2] == '~') {
                 switch (seq[1]) {
                     case '1': return HOME_KEY;
@@ -219,8 +580,88 @@ int editorReadKey() {
         }
         return '\x1b';
     }else {
-        return c;
+        return (unsigned char)c; // Bytes of UTF-8 chars shouldn't come out negative
+    }
+}
+
+// Input thread: decodes keys as they are typed and queues them for the core, so keys keep being taken
+// off the terminal while the core is busy and escape sequences never wait behind a redraw
+static void *inputThread(void *arg){
+    struct keyQueue *q = arg;
+    while(1){
+        char c;
+        int nread = read(q->fd, &c, 1);
+        int key;
+        if(nread == 1){
+            key = editorDecodeKey(q->fd, c);
+        }else if(nread == 0 || errno == EAGAIN || errno == EINTR){
+            continue; // VTIME ran out with nothing typed
+        }else{
+            q->err = errno;
+            key = -1;
+        }
+
+        unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        while(tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == KEY_QUEUE_SIZE) usleep(1000); // The core is behind, let the tty buffer hold the rest
+        q->keys[tail % KEY_QUEUE_SIZE] = key;
+        __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        write(q->wakeFd, &one, sizeof(one));
+        if(key == -1) return NULL;
+    }
+}
+
+void editorInputStart(){
+    struct keyQueue *q = calloc(1, sizeof(struct keyQueue));
+    if(!q) return;
+    q->fd = E.ttyFd;
+    q->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(q->wakeFd == -1){
+        free(q);
+        return;
+    }
+    if(pthread_create(&q->thread, NULL, inputThread, q) != 0){
+        close(q->wakeFd);
+        free(q);
+        return;
+    }
+    pthread_detach(q->thread); // Left blocked in read() at exit
+    E.input = q;
+}
+
+int editorReadKey() {
+    if(E.input){
+        struct keyQueue *q = E.input;
+        while(1){
+            unsigned head = q->head;
+            if(head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)){
+                int key = q->keys[head % KEY_QUEUE_SIZE];
+                __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+                if(key == -1){
+                    errno = q->err;
+                    die("read");
+                }
+                return key;
+            }
+            struct pollfd p = {q->wakeFd, POLLIN, 0};
+            int n = poll(&p, 1, 100);
+            if(n == -1 && errno != EINTR) die("poll");
+            if(n > 0){
+                uint64_t count;
+                read(q->wakeFd, &count, sizeof(count));
+            }else if(n == 0){
+                if (editorIdle()) editorRefreshScreen(); // Nothing typed in the last 100ms, let background work update the screen
+            }
+        }
     }
+
+    int nread; // Number of bytes read 
+    char c;
+    while ((nread = read(E.ttyFd, &c, 1)) != 1) {
+      if (nread == -1 && errno != EAGAIN) die("read");
+      if (editorIdle()) editorRefreshScreen(); // Nothing typed in the last 100ms, let background work update the screen
+    }
+    return editorDecodeKey(E.ttyFd, c);
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -233,7 +674,7 @@ int getCursorPosition(int *rows, int *cols) {
 
     // Read the terminal's response into buf
     while (i < sizeof(buf) - 1) {
-      if (read(STDIN_FILENO, &buf[i], 1) != 1) break; // Stop reading if read() fails
+      if (read(E.ttyFd, &buf[i], 1) != 1) break; // Stop reading if read() fails
       if (buf[i] == 'R') break; // Stopr reading when we reach R
       i++;
     }
@@ -258,13 +699,19 @@ int getWindowSize(int *rows, int *cols) {
 
 /*** Syntax Highlighting */
 int isSeparator(int c){
+    c = (unsigned char)c; // Bytes of UTF-8 chars come in as negative chars
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
-void editorUpdateSyntax(erow *row) {
+// Highlights one row, returns whether it changed the open comment state the next row starts in
+static int editorHighlightRow(erow *row) {
+    editorRowLoad(row);
     row->hl = realloc(row->hl, row->rsize);
     memset(row->hl, HL_NORMAL, row->rsize);
   
-    if (E.syntax == NULL) return;
+    if (E.syntax == NULL) {
+      editorBracketRowChanged(row);
+      return 0;
+    }
   
     char **keywords = E.syntax->keywords;
   
@@ -336,7 +783,7 @@ void editorUpdateSyntax(erow *row) {
       }
   
       if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-        if ((isdigit(c) && (prevSep || prev_hl == HL_NUMBER)) ||(c == '.' && prev_hl == HL_NUMBER)) {
+        if ((isdigit((unsigned char)c) && (prevSep || prev_hl == HL_NUMBER)) ||(c == '.' && prev_hl == HL_NUMBER)) {
           row->hl[i] = HL_NUMBER;
           i++;
           prevSep = 0;
@@ -369,10 +816,16 @@ void editorUpdateSyntax(erow *row) {
   
     int changed = (row->hlOpenComment != inComment);
     row->hlOpenComment = inComment;
-    if (changed && row->idx + 1 < E.numRows)
-      editorUpdateSyntax(&E.row[row->idx + 1]);
+    editorBracketRowChanged(row);
+    return changed;
   }
 
+// Following rows are redone for as long as the open comment state keeps changing. A loop rather
+// than recursion, opening a comment at the top of a huge file would otherwise overflow the stack
+void editorUpdateSyntax(erow *row) {
+    while (editorHighlightRow(row) && row->idx + 1 < E.numRows) row = &E.row[row->idx + 1];
+}
+
 int syntaxToColor(int hl){
     switch(hl){
         case HL_COMMENT:
@@ -382,6 +835,7 @@ int syntaxToColor(int hl){
         case HL_STRING: return YELLOW;
         case HL_NUMBER: return RED;
         case HL_MATCH: return CYAN;
+        case HL_BRACKET: return BRIGHT_RED;
         default: return WHITE;
     }
 }
@@ -391,12 +845,22 @@ void editorSelectSyntaxHighlight(){
 
     if (!E.filename) return;
     char *ext = strrchr(E.filename, '.');
+    size_t extLen = ext ? strlen(ext) : 0;
+    // A compressed file gets the type of what's inside it, foo.c.gz is C
+    if (ext && (!strcmp(ext, ".gz") || !strcmp(ext, ".zst"))) {
+        char *inner = ext;
+        while (inner > E.filename && inner[-1] != '.' && inner[-1] != '/') inner--;
+        if (inner > E.filename + 1 && inner[-1] == '.' && inner[-2] != '/') {
+            extLen = ext - (inner - 1);
+            ext = inner - 1;
+        }
+    }
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
         struct editorSyntax *s = &HLDB[j];
         unsigned int i = 0;
         while (s->fileMatch[i]) {
             int isExt = (s->fileMatch[i][0] == '.');
-            if ((isExt && ext && !strcmp(ext, s->fileMatch[i])) ||
+            if ((isExt && ext && strlen(s->fileMatch[i]) == extLen && !strncmp(ext, s->fileMatch[i], extLen)) ||
                 (!isExt && strstr(E.filename, s->fileMatch[i]))) {
                 E.syntax = s;
 
@@ -410,60 +874,468 @@ void editorSelectSyntaxHighlight(){
         }
     }
 }
+/*** UTF-8 ***/
+struct codepointRange{
+    int first;
+    int last;
+};
+
+// Combining marks and other codepoints that take up no column of their own
+static const struct codepointRange zeroWidth[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902},
+    {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+    {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+    {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF}
+};
+
+// East Asian Wide and Fullwidth codepoints, and the emoji blocks terminals draw two columns wide
+static const struct codepointRange doubleWidth[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x3247}, {0x3250, 0x4DBF}, {0x4E00, 0xA4CF}, {0xA960, 0xA97F},
+    {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60},
+    {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F64F},
+    {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+    {0x30000, 0x3FFFD}
+};
+
+static int inRanges(int cp, const struct codepointRange *ranges, int count){
+    if(cp < ranges[0].first || cp > ranges[count - 1].last) return 0;
+    int lo = 0, hi = count - 1;
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        if(cp < ranges[mid].first) hi = mid - 1;
+        else if(cp > ranges[mid].last) lo = mid + 1;
+        else return 1;
+    }
+    return 0;
+}
+
+int codepointWidth(int cp){
+    if(inRanges(cp, zeroWidth, sizeof(zeroWidth) / sizeof(zeroWidth[0]))) return 0;
+    if(inRanges(cp, doubleWidth, sizeof(doubleWidth) / sizeof(doubleWidth[0]))) return 2;
+    return 1;
+}
+
+// Decodes the UTF-8 sequence at s, returning its length in bytes and its width in columns. Anything that
+// isn't well formed (overlong, surrogate, truncated, C1 control) is a single byte one column wide, which
+// editorUpdateRow renders as '?', so every byte of a row always belongs to exactly one char
+int utf8Decode(const char *s, int len, int *width){
+    const unsigned char *u = (const unsigned char *)s;
+    int n, cp;
+    *width = 1;
+    if(u[0] < 0x80) return 1;
+    else if(u[0] >= 0xC2 && u[0] <= 0xDF){ n = 2; cp = u[0] & 0x1F; }
+    else if(u[0] >= 0xE0 && u[0] <= 0xEF){ n = 3; cp = u[0] & 0x0F; }
+    else if(u[0] >= 0xF0 && u[0] <= 0xF4){ n = 4; cp = u[0] & 0x07; }
+    else return 1;
+
+    if(n > len) return 1;
+    for(int i = 1; i < n; i++){
+        if((u[i] & 0xC0) != 0x80) return 1;
+        cp = (cp << 6) | (u[i] & 0x3F);
+    }
+    if((n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+       (cp >= 0xD800 && cp <= 0xDFFF) || cp < 0xA0) return 1;
+
+    *width = codepointWidth(cp);
+    return n;
+}
+
+// Length of the leading run of s with no tabs and no bytes >= 0x80, i.e. bytes that are exactly one
+// render byte and one column each. Checks 16 bytes at a time so mostly-ASCII rows skip decoding entirely
+int plainPrefixLen(const char *s, int len){
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t');
+    for(; i + 16 <= len; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+        int mask = _mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+        if(mask) return i + __builtin_ctz(mask);
+    }
+#else
+    for(; i + 8 <= len; i += 8){
+        uint64_t v;
+        memcpy(&v, &s[i], 8);
+        uint64_t tabs = v ^ 0x0909090909090909ULL;
+        if(((v | ((tabs - 0x0101010101010101ULL) & ~tabs)) & 0x8080808080808080ULL) != 0) break;
+    }
+#endif
+    while(i < len && (unsigned char)s[i] < 0x80 && s[i] != '\t') i++;
+    return i;
+}
+
+/*** Line offsets ***/
+static void lineOffsetsReserve(int rows){
+    struct lineOffsets *o = &E.offsets;
+    if(rows + 1 <= o->cap) return;
+    o->cap = (rows + 1) * 2;
+    o->tree = realloc(o->tree, sizeof(long long) * o->cap);
+}
+
+static long long lineOffsetsPrefix(int rows){
+    long long sum = 0;
+    for(int i = rows; i > 0; i -= i & -i) sum += E.offsets.tree[i];
+    return sum;
+}
+
+// O(n), only after rows were inserted or deleted somewhere other than the end
+static void lineOffsetsRebuild(){
+    struct lineOffsets *o = &E.offsets;
+    lineOffsetsReserve(E.numRows);
+    for(int i = 1; i <= E.numRows; i++) o->tree[i] = E.row[i - 1].savedLen;
+    for(int i = 1; i <= E.numRows; i++){
+        int parent = i + (i & -i);
+        if(parent <= E.numRows) o->tree[parent] += o->tree[i];
+    }
+    o->numRows = E.numRows;
+    o->dirty = 0;
+}
+
+// Called before a row is put in at `at`, with its savedLen still 0
+void editorLineOffsetsInsert(int at){
+    struct lineOffsets *o = &E.offsets;
+    if(o->dirty || at != o->numRows){
+        o->dirty = 1;
+        return;
+    }
+    // Appending: the new node covers (at + 1 - lowbit, at + 1], all rows already in the tree
+    lineOffsetsReserve(at + 1);
+    int i = at + 1;
+    o->tree[i] = lineOffsetsPrefix(i - 1) - lineOffsetsPrefix(i - (i & -i));
+    o->numRows++;
+}
+
+void editorLineOffsetsDelete(erow *row){
+    struct lineOffsets *o = &E.offsets;
+    o->totalBytes -= row->savedLen;
+    if(!o->dirty && row->idx == o->numRows - 1) o->numRows--; // Dropping the last row leaves the other nodes as they are
+    else o->dirty = 1;
+}
+
+// Called whenever a row's contents change
+void editorLineOffsetsUpdate(erow *row){
+    struct lineOffsets *o = &E.offsets;
+    int delta = row->size + 1 - row->savedLen;
+    row->savedLen = row->size + 1;
+    o->totalBytes += delta;
+    if(o->dirty || delta == 0 || row->idx >= o->numRows) return;
+    for(int i = row->idx + 1; i <= o->numRows; i += i & -i) o->tree[i] += delta;
+}
+
+// Offset in the saved file of the start of a line
+long long editorLineToOffset(int line){
+    if(E.offsets.dirty) lineOffsetsRebuild();
+    if(line > E.offsets.numRows) line = E.offsets.numRows;
+    return line > 0 ? lineOffsetsPrefix(line) : 0;
+}
+
+// Line that the byte at offset is on, found by walking down the tree
+int editorOffsetToLine(long long offset){
+    struct lineOffsets *o = &E.offsets;
+    if(o->dirty) lineOffsetsRebuild();
+    int line = 0;
+    int step = 1;
+    while(step * 2 <= o->numRows) step *= 2;
+    for(; step > 0; step /= 2){
+        if(line + step <= o->numRows && o->tree[line + step] <= offset){
+            line += step;
+            offset -= o->tree[line];
+        }
+    }
+    return line < E.numRows ? line : E.numRows - 1;
+}
+
+// Ctrl-G: jumps to a line number, a byte offset in the saved file (@1234) or a percentage of the
+// way through it (50%), through the line offset index rather than by walking the rows
+void editorGoto(){
+    char *query = editorPrompt("Go to: %s (line, @offset or percent%%, ESC to cancel)", NULL);
+    if(!query || E.numRows == 0){
+        free(query);
+        return;
+    }
+
+    char *p = query;
+    int byOffset = *p == '@';
+    if(byOffset) p++;
+    char *end;
+    errno = 0;
+    long long value = strtoll(p, &end, 10);
+    int percent = !byOffset && *end == '%';
+    if(percent) end++;
+    if(errno || end == p || *end || value < 0){
+        editorSetStatusMessage("Can't go to %s", query);
+        free(query);
+        return;
+    }
+    free(query);
+
+    long long offset = -1;
+    if(percent) offset = (value >= 100 ? E.offsets.totalBytes - 1 : E.offsets.totalBytes * value / 100);
+    else if(byOffset) offset = value < E.offsets.totalBytes ? value : E.offsets.totalBytes - 1;
+
+    if(offset >= 0){
+        E.cy = editorOffsetToLine(offset);
+        E.cx = offset - editorLineToOffset(E.cy);
+        erow *row = &E.row[E.cy];
+        if(E.cx > row->size) E.cx = row->size; // On the newline
+        while(E.cx > 0 && E.cx < row->size && (row->chars[E.cx] & 0xc0) == 0x80) E.cx--; // Inside a UTF-8 char
+    }else{
+        E.cy = value > 0 ? (value <= E.numRows ? value - 1 : E.numRows - 1) : 0;
+        E.cx = 0;
+    }
+
+    // Put the target in the middle of the screen, editorScroll keeps it there
+    E.rowOffset = E.cy - E.screenRows / 2;
+    if(E.rowOffset < 0) E.rowOffset = 0;
+    editorSetStatusMessage("Line %d, offset %lld", E.cy + 1, editorLineToOffset(E.cy) + E.cx);
+}
+
 /*** Row Operations ***/
+// Steps over the char at cx, returning its length in bytes and advancing rx (columns) and rbyte (render bytes)
+static int editorRowStep(erow *row, int cx, int *rx, int *rbyte) {
+    unsigned char c = row->chars[cx];
+    if (c == '\t') {
+      int w = TAB_STOPS - (*rx % TAB_STOPS);
+      *rx += w;
+      *rbyte += w;
+      return 1;
+    }
+    if (c < 0x80) {
+      (*rx)++;
+      (*rbyte)++;
+      return 1;
+    }
+    int width;
+    int n = utf8Decode(&row->chars[cx], row->size - cx, &width);
+    *rx += width;
+    *rbyte += n;
+    return n;
+}
+
+// Saves the position of the first char boundary at or after every RX_CHECKPOINT_STEP-th byte,
+// so conversions only ever scan one step of the row
+void editorRowBuildCheckpoints(erow *row) {
+    if (row->checkpoints) return;
+    row->checkpoints = malloc(sizeof(rowCheckpoint) * (row->size / RX_CHECKPOINT_STEP + 2));
+    int n = 0;
+    int cx = 0, rx = 0, rbyte = 0;
+    while (1) {
+      if (cx >= n * RX_CHECKPOINT_STEP) {
+        row->checkpoints[n].cx = cx;
+        row->checkpoints[n].rx = rx;
+        row->checkpoints[n].rbyte = rbyte;
+        n++;
+      }
+      if (cx >= row->size) break;
+      cx += editorRowStep(row, cx, &rx, &rbyte);
+    }
+    row->numCheckpoints = n;
+}
+
+// Finds the last checkpoint whose field (cx, rx or rbyte, all increasing along the row) is <= value
+static rowCheckpoint editorRowCheckpointBefore(erow *row, size_t field, int value) {
+    editorRowBuildCheckpoints(row);
+    int lo = 0, hi = row->numCheckpoints - 1;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      int v;
+      memcpy(&v, (char *)&row->checkpoints[mid] + field, sizeof(int));
+      if (v <= value) lo = mid;
+      else hi = mid - 1;
+    }
+    return row->checkpoints[lo];
+}
+
+// Rows of plain ASCII without tabs are the common case, there cx, rx and render bytes are all the same
+static int editorRowIsPlain(erow *row) {
+    editorRowLoad(row);
+    return row->ascii && !row->tabs;
+}
+
 int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-      if(row->chars[j] == '\t')
-        rx += (TAB_STOPS - 1) - (rx % TAB_STOPS);
-      rx++;
+    if (editorRowIsPlain(row)) return cx;
+    rowCheckpoint p = editorRowCheckpointBefore(row, offsetof(rowCheckpoint, cx), cx);
+    int rx = p.rx;
+    while (p.cx < cx) {
+      int prevRx = p.rx;
+      p.cx += editorRowStep(row, p.cx, &p.rx, &p.rbyte);
+      if (p.cx > cx) return prevRx; // cx is inside a multi-byte char, use where it starts
+      rx = p.rx;
     }
     return rx;
 }
 
 int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-      if (row->chars[cx] == '\t')
-        cur_rx += (TAB_STOPS - 1) - (cur_rx % TAB_STOPS);
-      cur_rx++;
-      if (cur_rx > rx) return cx;
+    if (editorRowIsPlain(row)) return rx < row->size ? rx : row->size;
+    rowCheckpoint p = editorRowCheckpointBefore(row, offsetof(rowCheckpoint, rx), rx);
+    while (p.cx < row->size) {
+      int cx = p.cx;
+      p.cx += editorRowStep(row, p.cx, &p.rx, &p.rbyte);
+      if (p.rx > rx) return cx;
     }
-    return cx;
+    return p.cx;
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
+// Maps an offset into render (e.g. a search match) back to the char it belongs to
+int editorRowRenderToCx(erow *row, int rbyte) {
+    if (editorRowIsPlain(row)) return rbyte < row->size ? rbyte : row->size;
+    rowCheckpoint p = editorRowCheckpointBefore(row, offsetof(rowCheckpoint, rbyte), rbyte);
+    while (p.cx < row->size) {
+      int cx = p.cx;
+      p.cx += editorRowStep(row, p.cx, &p.rx, &p.rbyte);
+      if (p.rbyte > rbyte) return cx;
+    }
+    return p.cx;
+}
 
-    for (int j = 0; j < row->size; j++)
-      if (row->chars[j] == '\t') tabs++;
+int editorRowCxToRender(erow *row, int cx) {
+    if (editorRowIsPlain(row)) return cx;
+    rowCheckpoint p = editorRowCheckpointBefore(row, offsetof(rowCheckpoint, cx), cx);
+    while (p.cx < cx) p.cx += editorRowStep(row, p.cx, &p.rx, &p.rbyte);
+    return p.rbyte;
+}
+
+// Offset into render of the first char that starts at or after column rx, and the column it starts at.
+// A double width char cut in half by rx is skipped, the caller pads the gap it leaves
+int editorRowRxToRender(erow *row, int rx, int *charRx) {
+    editorRowLoad(row);
+    if (row->ascii) { // Tabs are already spaces in render, so every render byte is one column
+      if (rx > row->rsize) rx = row->rsize;
+      *charRx = rx;
+      return rx;
+    }
+    rowCheckpoint p = editorRowCheckpointBefore(row, offsetof(rowCheckpoint, rx), rx);
+    while (p.cx < row->size) {
+      rowCheckpoint next = p;
+      next.cx += editorRowStep(row, p.cx, &next.rx, &next.rbyte);
+      if (p.rx >= rx && next.rx > p.rx) break; // Zero width chars belong with the char before them
+      p = next;
+    }
+    *charRx = p.rx;
+    return p.rbyte;
+}
+
+// Start of the char before cx, for moving left and backspacing over multi-byte chars
+int editorRowPrevChar(erow *row, int cx) {
+    if (cx <= 0) return 0;
+    for (int back = 2; back <= 4 && cx - back >= 0; back++) {
+      int width;
+      if (utf8Decode(&row->chars[cx - back], row->size - (cx - back), &width) == back) return cx - back;
+    }
+    return cx - 1;
+}
+
+int editorRowNextChar(erow *row, int cx) {
+    if (cx >= row->size) return row->size;
+    int width;
+    return cx + utf8Decode(&row->chars[cx], row->size - cx, &width);
+}
+
+// Builds render (and tabs, ascii) from chars, replacing whatever render the row had without freeing it
+static void editorRowBuildRender(erow *row) {
+    int tabs = 0;
+    for (const char *t = row->chars; (t = memchr(t, '\t', row->size - (t - row->chars))); t++)
+      tabs++;
+    row->tabs = tabs;
+    free(row->checkpoints);
+    row->checkpoints = NULL;
+    free(row->wrapStarts);
+    row->wrapStarts = NULL;
+    row->wrapWidth = 0;
 
-    free(row->render);
     row->render = malloc(row->size + tabs*(TAB_STOPS-1) + 1);
     int idx = 0;
-    for (int j = 0; j < row->size; j++) {
+    int rx = 0;
+    int ascii = 1;
+    int j = 0;
+    while (j < row->size) {
+      // Copy the plain ASCII stretch in one go, then deal with the tab or non-ASCII char that ended it
+      int run = plainPrefixLen(&row->chars[j], row->size - j);
+      memcpy(&row->render[idx], &row->chars[j], run);
+      idx += run;
+      rx += run;
+      j += run;
+      if (j >= row->size) break;
+
       if (row->chars[j] == '\t') {
         row->render[idx] = ' ';
         idx++;
-        while (idx % TAB_STOPS != 0){
+        rx++;
+        while (rx % TAB_STOPS != 0){
             row->render[idx++] = ' ';
+            rx++;
         }
+        j++;
       } else {
-        row->render[idx] = row->chars[j];
-        idx++;
+        int width;
+        int n = utf8Decode(&row->chars[j], row->size - j, &width);
+        if (n == 1) row->render[idx] = '?'; // Not valid UTF-8, don't send it to the terminal as is
+        else memcpy(&row->render[idx], &row->chars[j], n);
+        ascii = 0;
+        idx += n;
+        rx += width;
+        j += n;
       }
     }
     row->render[idx] = '\0';
     row->rsize = idx;
+    row->ascii = ascii;
+}
 
+void editorUpdateRow(erow *row) {
+    char *oldRender = row->render; // Kept until the new render is built so the word index can see what changed
+    int oldRsize = row->rsize;
+    editorRowBuildRender(row);
+    editorLineOffsetsUpdate(row);
+    row->origOff = -1; // No longer what is in the file
+    editorWordsRowChanged(oldRender, oldRsize, row->render, row->rsize);
+    free(oldRender);
     editorUpdateSyntax(row);
 }
+
+static void editorRowOwnChars(erow *row) {
+    if (!row->mapped) return;
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->mapped = 0;
+}
+
+// Rows loaded from the line index cache start out as a pointer into the file as read in and nothing else.
+// The row gets its own copy of chars and a render the first time something needs more than the raw bytes
+void editorRowLoad(erow *row) {
+    char *raw = row->mapped ? row->chars : NULL;
+    editorRowOwnChars(row);
+    if (row->render) return;
+    editorRowBuildRender(row);
+    // Its words were counted from the raw bytes, unless the worker hasn't got to them yet
+    if (raw && editorWordsClaim(raw, row->size)) editorWordsRowChanged(NULL, 0, row->render, row->rsize);
+    else editorWordsRowChanged(row->chars, row->size, row->render, row->rsize);
+}
+
+// Rows loaded from the line index cache get highlighted the first time they are looked at
+void editorRowHighlight(erow *row) {
+    editorRowLoad(row);
+    if (!row->hl) editorUpdateSyntax(row);
+}
 void editorInsertRow(int at, char *s, size_t len){
     if(at < 0 || at > E.numRows) return;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
+    if(E.numRows == E.rowCap){ // Grow geometrically so streaming in millions of rows stays linear
+        E.rowCap = E.rowCap ? E.rowCap * 2 : 16;
+        E.row = realloc(E.row, sizeof(erow) * E.rowCap);
+    }
     memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numRows - at));
     
     for(int j = at + 1; j <= E.numRows; j++) E.row[j].idx++;
@@ -479,13 +1351,25 @@ void editorInsertRow(int at, char *s, size_t len){
     E.row[at].render = NULL;
     E.row[at].hl = NULL;
     E.row[at].hlOpenComment = 0;
+    E.row[at].checkpoints = NULL;
+    E.row[at].wrapStarts = NULL;
+    E.row[at].mapped = 0;
+    E.row[at].brClose = 0;
+    E.row[at].brOpen = -1;
+    E.row[at].savedLen = 0;
+    E.row[at].origOff = -1;
+    editorLineOffsetsInsert(at);
+    editorFoldRowInserted(at);
+    editorBracketRowInserted(at);
     editorUpdateRow(&E.row[at]);
 
     E.numRows++;
     E.dirty++;
+    editorJournalRecord(JOURNAL_INSERT_ROW, at, 0, s, len);
 }
 
 void editorRowInsertChar(erow *row, int at, int c){
+    editorRowLoad(row);
     if(at < 0 || at > row->size) at = row->size; // Validate the spot where we are inserting a new char
     row->chars = realloc(row->chars, row->size + 2); // Make room for the new character and the null terminator
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // Shift the chars to the right of teh insert down one
@@ -493,38 +1377,64 @@ void editorRowInsertChar(erow *row, int at, int c){
     row->chars[at] = c; // insert the new char
     editorUpdateRow(row);  // Update the render fields, handle things like tabs
     E.dirty++;
+    char ch = c;
+    editorJournalRecord(JOURNAL_INSERT_CHAR, row->idx, at, &ch, 1);
 }
 
 void editorRowDeleteChar(erow *row, int at){
+    editorRowLoad(row);
     if(at < 0 || at > row->size) at = row->size; // Validate the spot where we are inserting a mew char
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
     editorUpdateRow(row);
     E.dirty++;
+    editorJournalRecord(JOURNAL_DELETE_CHAR, row->idx, at, NULL, 0);
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len){
+    editorRowLoad(row);
     row->chars = realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
     editorUpdateRow(row);
     E.dirty++;
+    editorJournalRecord(JOURNAL_APPEND_STRING, row->idx, 0, s, len);
+}
+
+// Cuts the row off at `at`
+void editorRowTruncate(erow *row, int at){
+    editorRowLoad(row);
+    if(at < 0 || at > row->size) return;
+    row->size = at;
+    row->chars[at] = '\0';
+    editorUpdateRow(row);
+    E.dirty++;
+    editorJournalRecord(JOURNAL_TRUNCATE_ROW, row->idx, at, NULL, 0);
 }
 
 void editorFreeRow(erow *row){
+    if(row->render) editorWordsRowChanged(row->render, row->rsize, NULL, 0);
+    else if(!row->mapped || !editorWordsClaim(row->chars, row->size))
+        editorWordsRowChanged(row->chars, row->size, NULL, 0); // Never loaded, its words were counted from the raw bytes
     free(row->render);
-    free(row->chars);
+    if(!row->mapped) free(row->chars);
     free(row->hl);
+    free(row->checkpoints);
+    free(row->wrapStarts);
 }
 
 void editorDeleteRow(int at){
     if(at < 0 || at >= E.numRows) return;
+    editorLineOffsetsDelete(&E.row[at]);
+    editorFoldRowDeleted(at);
+    editorBracketRowDeleted(at);
     editorFreeRow(&E.row[at]);
     memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numRows - at - 1)); // Replace the curr row with alll the rows ahead of it
     for(int j = at; j < E.numRows - 1; j++) E.row[j].idx--;
     E.numRows--;
     E.dirty++;
+    editorJournalRecord(JOURNAL_DELETE_ROW, at, 0, NULL, 0);
 }
 
 void editorDeleteChar(){
@@ -533,8 +1443,11 @@ void editorDeleteChar(){
 
     erow *row = &E.row[E.cy];
     if(E.cx > 0){
-        editorRowDeleteChar(row, E.cx - 1);
-        E.cx--;
+        int start = editorRowPrevChar(row, E.cx); // Remove every byte of a multi-byte char
+        while(E.cx > start){
+            editorRowDeleteChar(row, E.cx - 1);
+            E.cx--;
+        }
     }else{
         E.cx = E.row[E.cy-1].size;
         editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
@@ -560,215 +1473,3697 @@ void editorInsertNewline() {
     } else {
       erow *row = &E.row[E.cy];
       editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-      row = &E.row[E.cy];
-      row->size = E.cx;
-      row->chars[row->size] = '\0';
-      editorUpdateRow(row);
+      editorRowTruncate(&E.row[E.cy], E.cx);
     }
     E.cy++;
     E.cx = 0;
 }
 
-/*** File Input/Output  ***/
-char *editorRowsToString(int *bufLen){
-    int totalLen = 0;
-    for(int j = 0; j < E.numRows; j++){
-        totalLen += E.row[j].size + 1; // Get the total length of the curr line + 1 for the \n
+/*** Line index cache ***/
+static uint64_t fnv1a(uint64_t h, const unsigned char *p, size_t len){
+    for(size_t i = 0; i < len; i++){
+        h ^= p[i];
+        h *= 1099511628211ULL;
     }
-    *bufLen = totalLen; // Store the length of the file in bufLen
+    return h;
+}
 
-    char *buf = malloc(totalLen); // Store enough spcae for the whole file
-    char *p = buf; // Get a pointer that points to the beginning of the file
-    for(int j = 0; j < E.numRows; j++){
-        memcpy(p, E.row[j].chars, E.row[j].size); // Copy the current line to the pointer 
-        p += E.row[j].size; // Move the pointer to the end of the current line
-        *p =  '\n'; // Add a new line character
-        p++; // Move the pointer one spot past the new line to be ready for the next line
+// Hashes the first and last blocks and evenly spaced samples in between. Together with size, mtime
+// and inode that catches real changes without reading all of a multi-GB file on every open
+static uint64_t cacheContentHash(int fd, uint64_t size){
+    unsigned char *buf = malloc(CACHE_SAMPLE_SIZE);
+    uint64_t h = 14695981039346656037ULL;
+    for(int i = 0; i <= CACHE_SAMPLES; i++){
+        uint64_t off = size > CACHE_SAMPLE_SIZE ? (size - CACHE_SAMPLE_SIZE) / CACHE_SAMPLES * i : 0;
+        ssize_t n = pread(fd, buf, CACHE_SAMPLE_SIZE, off);
+        if(n > 0) h = fnv1a(h, buf, n);
+        if(size <= CACHE_SAMPLE_SIZE) break;
     }
+    free(buf);
+    return h;
+}
 
-    return buf;
+// Cache files live in $XDG_CACHE_HOME/text-editor (or ~/.cache/text-editor), named after a hash of the
+// file's absolute path. Returns NULL if caching is off or the file is too small to bother with
+static char *cachePathFor(const char *filename, char *absPath){
+    if(getenv("TEXT_EDITOR_NO_CACHE")) return NULL;
+    if(!realpath(filename, absPath)) return NULL;
+
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    if(base && *base) snprintf(dir, sizeof(dir), "%s/text-editor", base);
+    else if(home) snprintf(dir, sizeof(dir), "%s/.cache/text-editor", home);
+    else return NULL;
+
+    char *path = malloc(strlen(dir) + 32);
+    uint64_t h = fnv1a(14695981039346656037ULL, (const unsigned char *)absPath, strlen(absPath));
+    sprintf(path, "%s/%016llx.idx", dir, (unsigned long long)h);
+    return path;
 }
 
-void editorSave(){
-    if(E.filename == NULL){
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if(E.filename == NULL){
-            editorSetStatusMessage("Save Aborted Sucessfully!");
-            return;
+static void cacheStamp(struct lineCacheHeader *h, int fd, struct stat *st, const char *absPath){
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CACHE_MAGIC, 4);
+    h->version = CACHE_VERSION;
+    h->fileSize = st->st_size;
+    h->mtimeSec = st->st_mtim.tv_sec;
+    h->mtimeNsec = st->st_mtim.tv_nsec;
+    h->inode = st->st_ino;
+    h->hash = cacheContentHash(fd, st->st_size);
+    snprintf(h->fileType, sizeof(h->fileType), "%s", E.syntax ? E.syntax->fileType : "");
+    h->pathLen = strlen(absPath);
+}
+
+#define CACHE_PATH_SPACE(len) (((len) + 7) & ~7)
+
+// Loads the rows of filename using its cached line index, skipping the newline scan and all of the
+// highlighting. The file is read in as one block and every row starts out pointing into it, editorRowLoad
+// copies and renders a row once it is used. It is read rather than mapped, as a mapped row would SIGBUS
+// once another process truncates the file (a copytruncate log rotation). Returns 0 without touching the
+// buffer if there is no cache or it doesn't match the file. Batch workers run side by side on the same
+// files, so they don't use it at all
+int editorCacheLoad(const char *filename){
+    if(E.headless) return 0;
+    char absPath[PATH_MAX];
+    char *path = cachePathFor(filename, absPath);
+    if(!path) return 0;
+
+    int fd = open(filename, O_RDONLY);
+    int cfd = open(path, O_RDONLY);
+    struct stat st, cst;
+    char *cache = MAP_FAILED, *data = NULL;
+    int loaded = 0;
+    if(fd == -1 || cfd == -1 || fstat(fd, &st) == -1 || fstat(cfd, &cst) == -1) goto done;
+    if(!S_ISREG(st.st_mode) || st.st_size < CACHE_MIN_SIZE || cst.st_size < (off_t)sizeof(struct lineCacheHeader)) goto done;
+
+    cache = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+    if(cache == MAP_FAILED) goto done;
+
+    struct lineCacheHeader h, want;
+    memcpy(&h, cache, sizeof(h));
+    cacheStamp(&want, fd, &st, absPath);
+    uint64_t pathSpace = CACHE_PATH_SPACE((uint64_t)h.pathLen);
+    uint64_t lensOff = sizeof(h) + pathSpace;
+    uint64_t bitsOff = lensOff + h.numRows * 4;
+    uint64_t bitsLen = (h.numRows + 7) / 8;
+    int stale = memcmp(h.magic, want.magic, 4) || h.version != want.version ||
+        h.fileSize != want.fileSize || h.mtimeSec != want.mtimeSec || h.mtimeNsec != want.mtimeNsec ||
+        h.inode != want.inode || h.hash != want.hash || memcmp(h.fileType, want.fileType, sizeof(h.fileType)) ||
+        h.pathLen != want.pathLen || h.numRows > INT_MAX || bitsOff + 2 * bitsLen != (uint64_t)cst.st_size ||
+        memcmp(&cache[sizeof(h)], absPath, h.pathLen);
+
+    // The line lengths have to add up to exactly the file, anything else means the index is damaged
+    const uint32_t *lens = (const uint32_t *)&cache[lensOff];
+    if(!stale){
+        uint64_t total = 0;
+        for(uint64_t i = 0; i < h.numRows && total <= h.fileSize; i++){
+            uint32_t len;
+            memcpy(&len, &lens[i], 4);
+            if(len == 0) total = h.fileSize + 1;
+            total += len;
         }
-        editorSelectSyntaxHighlight();
+        stale = total != h.fileSize;
+    }
+    if(stale){
+        unlink(path);
+        goto done;
     }
 
-    int len;
-    char *buf = editorRowsToString(&len); // Get the file contents stored in buf, and have the length of it stored in len
+    // One sequential read, a file that got shorter since the stamp was taken fails it and gets a plain load
+    data = malloc(st.st_size);
+    if(!data || lseek(fd, 0, SEEK_SET) == -1 || journalReadAll(fd, data, st.st_size) == -1) goto done;
 
-    int fd = (open(E.filename, O_RDWR | O_CREAT, 0644)); // Open the file with Read/Write permission, or create the file if its not there
-    if(fd != -1){ // Makes sure file was opend successfully
-        if(ftruncate(fd, len) != -1){ // Makes sure the memory allocation for teh file was successful
-            if(write(fd, buf, len) == len){ // Makes sure the write to file was successful
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+    // Only lines that end in something other than '\n' (a "\r\n" or no newline at all) get looked at
+    // here, the rest are just pointers into data until a row is used
+    const unsigned char *bits = (const unsigned char *)&cache[bitsOff];
+    const unsigned char *plainBits = &bits[bitsLen];
+    E.rowCap = h.numRows;
+    E.row = realloc(E.row, sizeof(erow) * (E.rowCap ? E.rowCap : 1));
+    E.lineLens = malloc(sizeof(uint32_t) * (h.numRows ? h.numRows : 1));
+    E.numLineLens = h.numRows;
+    uint64_t off = 0;
+    for(uint64_t i = 0; i < h.numRows; i++){
+        uint32_t len;
+        memcpy(&len, &lens[i], 4);
+        E.lineLens[i] = len;
+        char *line = &data[off];
+        erow *row = &E.row[i];
+        memset(row, 0, sizeof(*row));
+        if((plainBits[i / 8] >> (i % 8)) & 1){
+            row->size = len - 1;
+            row->origOff = off;
+        }else{
+            int lineLen = len;
+            while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) lineLen--;
+            row->size = lineLen;
+            editorRowSetOrigin(row, off, line, len);
         }
-        close(fd); // If file was opened but eveyrthing else fails, still close teh file;
+        row->idx = i;
+        row->chars = line;
+        row->mapped = 1;
+        row->savedLen = row->size + 1;
+        row->brOpen = -1;
+        row->hlOpenComment = (bits[i / 8] >> (i % 8)) & 1;
+        E.offsets.totalBytes += row->savedLen;
+        off += len;
     }
+    E.numRows = h.numRows;
+    E.offsets.dirty = 1; // Built on first use, in one O(n) pass
+    if(E.brackets) E.brackets->dirty = 1;
+    E.loadBuf = data;
+    E.loadBufLen = st.st_size;
+    data = NULL;
+    editorWordsAddBulk(E.loadBuf, E.loadBufLen); // Completion knows the whole file, not just the rows looked at
+    E.loadedBytes = st.st_size;
+    E.loadedPartial = h.numRows && E.loadBuf[st.st_size - 1] != '\n';
 
-    free(buf); // Free the buffer holding the file anyway    
-    editorSetStatusMessage("Can't Save! I/O Error: %s", strerror(errno));
+    // Put the user back where they left off
+    if(h.cy >= 0 && h.cy <= E.numRows) E.cy = h.cy;
+    if(h.rowOffset >= 0 && h.rowOffset <= E.cy) E.rowOffset = h.rowOffset;
+    if(E.cy < E.numRows && h.cx >= 0 && h.cx <= E.row[E.cy].size) E.cx = h.cx;
+    if(h.colOffset >= 0) E.colOffset = h.colOffset;
+    editorSaveSourceSet(fd);
+    loaded = 1;
+
+done:
+    free(data);
+    if(cache != MAP_FAILED) munmap(cache, cst.st_size);
+    if(fd != -1) close(fd);
+    if(cfd != -1) close(cfd);
+    free(path);
+    return loaded;
 }
 
-void editorOpen(char *filename) {
+// Writes the line index for the file as it is on disk right now. Only valid while the buffer matches
+// the file, so callers skip it when there are unsaved changes
+void editorCacheSave(){
+    if(!E.filename || E.dirty || E.follow || E.loader || E.headless || E.compression) return;
+    char absPath[PATH_MAX];
+    char *path = cachePathFor(E.filename, absPath);
+    if(!path) return;
 
-    free(E.filename);  // Avoid memory leaks
-    E.filename = malloc(strlen(filename) + 1);  // Allocate space for filename
+    struct stat st;
+    int fd = open(E.filename, O_RDONLY);
+    if(fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < CACHE_MIN_SIZE ||
+       !E.lineLens || E.numLineLens != E.numRows){
+        if(fd != -1) close(fd);
+        free(path);
+        return;
+    }
 
-    strcpy(E.filename, filename);  // Copy filename manually
+    struct lineCacheHeader h;
+    cacheStamp(&h, fd, &st, absPath);
+    close(fd);
+    h.numRows = E.numRows;
+    h.cy = E.cy;
+    h.cx = E.cx;
+    h.rowOffset = E.rowOffset;
+    h.colOffset = E.colOffset;
 
-    editorSelectSyntaxHighlight();
+    size_t pathSpace = CACHE_PATH_SPACE(h.pathLen);
+    size_t bitsLen = (E.numRows + 7) / 8;
+    size_t total = sizeof(h) + pathSpace + (size_t)E.numRows * 4 + 2 * bitsLen;
+    char *buf = calloc(1, total);
+    memcpy(buf, &h, sizeof(h));
+    memcpy(&buf[sizeof(h)], absPath, h.pathLen);
+    char *lens = &buf[sizeof(h) + pathSpace];
+    unsigned char *bits = (unsigned char *)&lens[(size_t)E.numRows * 4];
+    unsigned char *plainBits = &bits[bitsLen];
+    for(int i = 0; i < E.numRows; i++){
+        uint32_t len = E.lineLens[i];
+        memcpy(&lens[(size_t)i * 4], &len, 4);
+        if(E.row[i].hlOpenComment) bits[i / 8] |= 1 << (i % 8);
+        if(E.row[i].origOff != -1) plainBits[i / 8] |= 1 << (i % 8); // Exactly its chars and a '\n' in the file
+    }
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+    // Make the cache directory (and ~/.cache itself) if this is the first time
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    char *parent = strrchr(path, '/');
+    *parent = '\0';
+    mkdir(path, 0700);
+    *parent = '/';
+    mkdir(path, 0700);
+    *slash = '/';
 
-    char *line = NULL;
+    char *tmp = malloc(strlen(path) + 16);
+    sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+    int cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(cfd != -1){
+        int ok = journalWriteAll(cfd, buf, total) == 0;
+        close(cfd);
+        if(!ok || rename(tmp, path) == -1) unlink(tmp);
+    }
+    free(tmp);
+    free(buf);
+    free(path);
+}
+
+/*** Bracket matching ***/
+static int isOpenBracket(char c){
+    return c == '(' || c == '[' || c == '{';
+}
+
+static int isCloseBracket(char c){
+    return c == ')' || c == ']' || c == '}';
+}
+
+// Brackets in strings and comments don't count
+static int isCodeBracket(erow *row, int at){
+    int hl = row->hl[at];
+    return (isOpenBracket(row->render[at]) || isCloseBracket(row->render[at])) &&
+        hl != HL_STRING && hl != HL_COMMENT && hl != HL_MLCOMMENT;
+}
+
+static void bracketRowSummary(erow *row){
+    editorRowHighlight(row);
+    int open = 0, close = 0;
+    for(int j = 0; j < row->rsize; j++){
+        char c = row->render[j];
+        if(!isOpenBracket(c) && !isCloseBracket(c)) continue;
+        if(!isCodeBracket(row, j)) continue;
+        if(isOpenBracket(c)) open++;
+        else if(open > 0) open--;
+        else close++;
+    }
+    row->brOpen = open;
+    row->brClose = close;
+}
+
+// Combines two adjacent ranges: opens left over on the left are closed by closes left over on the right
+static void bracketPull(struct bracketIndex *b, int node){
+    int l = node * 2, r = node * 2 + 1;
+    int matched = b->open[l] < b->close[r] ? b->open[l] : b->close[r];
+    b->close[node] = b->close[l] + b->close[r] - matched;
+    b->open[node] = b->open[l] - matched + b->open[r];
+    b->known[node] = 1;
+}
+
+// Cuts the rows into blocks of BRACKET_BLOCK_ROWS. Nothing gets summed up yet, the rows keep their own summaries
+static void bracketRebuild(struct bracketIndex *b){
+    int blocks = (E.numRows + BRACKET_BLOCK_ROWS - 1) / BRACKET_BLOCK_ROWS;
+    if(blocks < 1) blocks = 1;
+    int size = 1;
+    while(size < blocks) size *= 2;
+    if(size != b->size){
+        b->size = size;
+        b->close = realloc(b->close, sizeof(int) * size * 2);
+        b->open = realloc(b->open, sizeof(int) * size * 2);
+        b->rows = realloc(b->rows, sizeof(int) * size * 2);
+        b->known = realloc(b->known, size * 2);
+    }
+    memset(b->known, 0, size * 2);
+    for(int i = 0; i < size; i++){
+        int left = E.numRows - i * BRACKET_BLOCK_ROWS;
+        b->rows[size + i] = left < 0 ? 0 : left < BRACKET_BLOCK_ROWS ? left : BRACKET_BLOCK_ROWS;
+    }
+    for(int node = size - 1; node >= 1; node--) b->rows[node] = b->rows[node * 2] + b->rows[node * 2 + 1];
+    b->numBlocks = blocks;
+    b->dirty = 0;
+}
+
+// Leaf holding row y, with the first row of that leaf in start
+static int bracketLeafOf(struct bracketIndex *b, int y, int *start){
+    int node = 1;
+    *start = 0;
+    while(node < b->size){
+        node *= 2;
+        if(y - *start >= b->rows[node]){
+            *start += b->rows[node];
+            node++;
+        }
+    }
+    return node;
+}
+
+// Walks from a leaf up to the root adding delta to the row counts and marking the sums stale
+static void bracketTouch(struct bracketIndex *b, int node, int delta){
+    for(; node >= 1; node /= 2){
+        b->rows[node] += delta;
+        b->known[node] = 0;
+    }
+}
+
+// Sums up a whole leaf from its rows
+static void bracketLeafSum(struct bracketIndex *b, int node, int start){
+    int open = 0, close = 0;
+    for(int i = start; i < start + b->rows[node]; i++){
+        erow *row = &E.row[i];
+        if(row->brOpen == -1) bracketRowSummary(row);
+        int matched = open < row->brClose ? open : row->brClose;
+        close += row->brClose - matched;
+        open = open - matched + row->brOpen;
+    }
+    b->close[node] = close;
+    b->open[node] = open;
+    b->known[node] = 1;
+}
+
+// Keeps the index up to date as rows are re-highlighted: the row is summed up again right away, the
+// block it is in and the nodes above only get marked
+void editorBracketRowChanged(erow *row){
+    struct bracketIndex *b = E.brackets;
+    if(!b){
+        row->brOpen = -1; // Whatever it was, it's stale now
+        return;
+    }
+    bracketRowSummary(row);
+    if(b->dirty || row->idx >= b->rows[1]) return;
+    int start;
+    bracketTouch(b, bracketLeafOf(b, row->idx, &start), 0);
+}
+
+// Called before a row goes in at `at`. It joins the block of the row before it, or starts the next
+// empty leaf when appending to a full last block
+void editorBracketRowInserted(int at){
+    struct bracketIndex *b = E.brackets;
+    if(!b || b->dirty) return;
+    if(b->rows[1] == 0){
+        b->dirty = 1;
+        return;
+    }
+    int start;
+    int node = bracketLeafOf(b, at > 0 ? at - 1 : 0, &start);
+    if(at == b->rows[1] && b->rows[node] >= BRACKET_BLOCK_ROWS && b->numBlocks < b->size){
+        node = b->size + b->numBlocks++;
+    }
+    bracketTouch(b, node, 1);
+    if(b->rows[node] > 2 * BRACKET_BLOCK_ROWS) b->dirty = 1;
+}
+
+// Called before row `at` is removed
+void editorBracketRowDeleted(int at){
+    struct bracketIndex *b = E.brackets;
+    if(!b || b->dirty || at >= b->rows[1]) return;
+    int start;
+    bracketTouch(b, bracketLeafOf(b, at, &start), -1);
+}
+
+static struct bracketIndex *bracketIndexGet(){
+    if(!E.brackets){
+        // First use: the rows are summed up lazily, only those a lookup actually passes over
+        E.brackets = calloc(1, sizeof(struct bracketIndex));
+        E.brackets->dirty = 1;
+    }
+    if(E.brackets->dirty) bracketRebuild(E.brackets);
+    return E.brackets;
+}
+
+// First row from `from` on where the `need` brackets still open get closed, or -1. A node wholly after
+// from is skipped in one step once its sums are known; if they aren't, it is searched and summed on the way
+static int bracketFindForward(struct bracketIndex *b, int node, int start, int from, int *need){
+    int count = b->rows[node];
+    if(count == 0 || start + count <= from) return -1;
+    int whole = start >= from;
+    if(whole && b->known[node] && b->close[node] < *need){
+        *need = *need - b->close[node] + b->open[node];
+        return -1;
+    }
+    if(node >= b->size){
+        for(int i = whole ? start : from; i < start + count; i++){
+            erow *row = &E.row[i];
+            if(row->brOpen == -1) bracketRowSummary(row);
+            if(row->brClose >= *need) return i;
+            *need = *need - row->brClose + row->brOpen;
+        }
+        if(whole) bracketLeafSum(b, node, start);
+        return -1;
+    }
+    int found = bracketFindForward(b, node * 2, start, from, need);
+    if(found == -1) found = bracketFindForward(b, node * 2 + 1, start + b->rows[node * 2], from, need);
+    if(found == -1 && whole && b->known[node * 2] && b->known[node * 2 + 1]) bracketPull(b, node);
+    return found;
+}
+
+// Last row up to `from` where the `need` brackets still unmatched get opened, or -1
+static int bracketFindBackward(struct bracketIndex *b, int node, int start, int from, int *need){
+    int count = b->rows[node];
+    if(count == 0 || start > from) return -1;
+    int whole = start + count - 1 <= from;
+    if(whole && b->known[node] && b->open[node] < *need){
+        *need = *need - b->open[node] + b->close[node];
+        return -1;
+    }
+    if(node >= b->size){
+        for(int i = whole ? start + count - 1 : from; i >= start; i--){
+            erow *row = &E.row[i];
+            if(row->brOpen == -1) bracketRowSummary(row);
+            if(row->brOpen >= *need) return i;
+            *need = *need - row->brOpen + row->brClose;
+        }
+        if(whole) bracketLeafSum(b, node, start);
+        return -1;
+    }
+    int found = bracketFindBackward(b, node * 2 + 1, start + b->rows[node * 2], from, need);
+    if(found == -1) found = bracketFindBackward(b, node * 2, start, from, need);
+    if(found == -1 && whole && b->known[node * 2] && b->known[node * 2 + 1]) bracketPull(b, node);
+    return found;
+}
+
+// Scans the code brackets of row from start (exclusive) in direction dir, returning the render offset
+// where depth drops to zero, or -1 with depth set to what is still unmatched at the end of the row
+static int bracketScanRow(erow *row, int start, int dir, int *depth){
+    editorRowHighlight(row);
+    for(int j = start + dir; j >= 0 && j < row->rsize; j += dir){
+        if(!isCodeBracket(row, j)) continue;
+        int opens = isOpenBracket(row->render[j]);
+        if(opens == (dir > 0)) (*depth)++;
+        else if(--(*depth) == 0) return j;
+    }
+    return -1;
+}
+
+// Finds the bracket matching the one at render offset `at` of row y. Returns 1 and its position if
+// there is one of the right kind
+int editorFindBracketMatch(int y, int at, int *matchY, int *matchAt){
+    if(y < 0 || y >= E.numRows) return 0;
+    erow *row = &E.row[y];
+    editorRowHighlight(row);
+    if(at < 0 || at >= row->rsize || !isCodeBracket(row, at)) return 0;
+
+    char c = row->render[at];
+    int dir = isOpenBracket(c) ? 1 : -1;
+    int depth = 1;
+    int my = y;
+    int mat = bracketScanRow(row, at, dir, &depth);
+    if(mat == -1){
+        // Not on this row, let the tree find the row the match is on and scan just that row
+        struct bracketIndex *b = bracketIndexGet();
+        int need = depth;
+        my = dir > 0 ? bracketFindForward(b, 1, 0, y + 1, &need)
+                     : bracketFindBackward(b, 1, 0, y - 1, &need);
+        if(my < 0 || my >= E.numRows) return 0;
+        erow *other = &E.row[my];
+        mat = bracketScanRow(other, dir > 0 ? -1 : other->rsize, dir, &need);
+        if(mat == -1) return 0;
+    }
+
+    static const char pairs[] = "()[]{}";
+    char want = pairs[(strchr(pairs, c) - pairs) ^ 1];
+    if(E.row[my].render[mat] != want) return 0;
+    *matchY = my;
+    *matchAt = mat;
+    return 1;
+}
+
+// Looks for a bracket under the cursor and its match, for jumping and highlighting
+int editorCursorBracketMatch(int *cursorAt, int *matchY, int *matchAt){
+    if(E.cy >= E.numRows) return 0;
+    erow *row = &E.row[E.cy];
+    if(E.cx >= row->size) return 0;
+    char c = row->chars[E.cx];
+    if(!isOpenBracket(c) && !isCloseBracket(c)) return 0;
+    *cursorAt = editorRowCxToRender(row, E.cx);
+    return editorFindBracketMatch(E.cy, *cursorAt, matchY, matchAt);
+}
+
+void editorJumpToBracket(){
+    int at, my, mat;
+    if(!editorCursorBracketMatch(&at, &my, &mat)){
+        editorSetStatusMessage("No matching bracket");
+        return;
+    }
+    E.cy = my;
+    E.cx = editorRowRenderToCx(&E.row[my], mat);
+}
+
+/*** Folding ***/
+// A fold as it stands, with the shift still pending for the folds from the gap on
+static struct fold foldGet(int i){
+    struct fold fold = E.folds.folds[i];
+    if(i >= E.folds.gap){
+        fold.start += E.folds.shift;
+        fold.end += E.folds.shift;
+        fold.hiddenBefore += E.folds.hiddenShift;
+    }
+    return fold;
+}
+
+// Moves the gap to fold i, settling the shift on the folds it passes over. Row edits happen near each other,
+// so this is usually only a fold or two
+static void foldMoveGap(int i){
+    struct foldIndex *f = &E.folds;
+    while(f->gap < i){
+        struct fold *fold = &f->folds[f->gap++];
+        fold->start += f->shift;
+        fold->end += f->shift;
+        fold->hiddenBefore += f->hiddenShift;
+    }
+    while(f->gap > i){
+        struct fold *fold = &f->folds[--f->gap];
+        fold->start -= f->shift;
+        fold->end -= f->shift;
+        fold->hiddenBefore -= f->hiddenShift;
+    }
+}
+
+// Settles every fold, before the array itself is changed
+static void foldSettle(){
+    foldMoveGap(E.folds.numFolds);
+    E.folds.gap = 0; // Nothing pending, so where the gap is doesn't matter
+    E.folds.shift = 0;
+    E.folds.hiddenShift = 0;
+}
+
+// Recomputes hiddenBefore for the folds from i on, which have to be settled
+static void foldRecount(int i){
+    struct foldIndex *f = &E.folds;
+    int hidden = i > 0 ? f->folds[i - 1].hiddenBefore + f->folds[i - 1].end - f->folds[i - 1].start + 1 : 0;
+    for(; i < f->numFolds; i++){
+        f->folds[i].hiddenBefore = hidden;
+        hidden += f->folds[i].end - f->folds[i].start + 1;
+    }
+    f->hidden = hidden;
+}
+
+// First fold that ends at or after row
+static int foldFind(int row){
+    int lo = 0, hi = E.folds.numFolds;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(foldGet(mid).end < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// The fold hiding row, or -1
+int editorFoldAt(int row){
+    int i = foldFind(row);
+    return i < E.folds.numFolds && foldGet(i).start <= row ? i : -1;
+}
+
+// First and last row hidden by fold i
+void editorFoldRange(int i, int *start, int *end){
+    struct fold fold = foldGet(i);
+    *start = fold.start;
+    *end = fold.end;
+}
+
+// Next row down that isn't folded away, E.numRows past the last one
+int editorNextVisible(int row){
+    int i = editorFoldAt(row + 1);
+    return i == -1 ? row + 1 : foldGet(i).end + 1;
+}
+
+int editorPrevVisible(int row){
+    int i = editorFoldAt(row - 1);
+    return i == -1 ? row - 1 : foldGet(i).start - 1;
+}
+
+// Which line of the screen's worth of unfolded rows a visible row is, counting from the top of the file
+int editorVisibleLine(int row){
+    int i = foldFind(row);
+    return row - (i < E.folds.numFolds ? foldGet(i).hiddenBefore : E.folds.hidden);
+}
+
+int editorVisibleToRow(int line){
+    // Last fold that starts at or before line once the folds ahead of it are collapsed
+    int lo = 0, hi = E.folds.numFolds;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        struct fold fold = foldGet(mid);
+        if(fold.start - fold.hiddenBefore <= line) lo = mid + 1;
+        else hi = mid;
+    }
+    return line + (lo < E.folds.numFolds ? foldGet(lo).hiddenBefore : E.folds.hidden);
+}
+
+void editorFoldRemove(int i){
+    struct foldIndex *f = &E.folds;
+    foldSettle();
+    memmove(&f->folds[i], &f->folds[i + 1], sizeof(struct fold) * (f->numFolds - i - 1));
+    f->numFolds--;
+    foldRecount(i);
+}
+
+// Hides rows [start, end]. Folds overlapping or touching it are swallowed into it
+static void foldAdd(int start, int end){
+    struct foldIndex *f = &E.folds;
+    foldSettle();
+    int i = foldFind(start - 1);
+    int j = i;
+    while(j < f->numFolds && f->folds[j].start <= end + 1){
+        if(f->folds[j].start < start) start = f->folds[j].start;
+        if(f->folds[j].end > end) end = f->folds[j].end;
+        j++;
+    }
+    if(j == i){
+        if(f->numFolds == f->cap){
+            f->cap = f->cap ? f->cap * 2 : 16;
+            f->folds = realloc(f->folds, sizeof(struct fold) * f->cap);
+        }
+        memmove(&f->folds[i + 1], &f->folds[i], sizeof(struct fold) * (f->numFolds - i));
+        f->numFolds++;
+    }else if(j > i + 1){
+        memmove(&f->folds[i + 1], &f->folds[j], sizeof(struct fold) * (f->numFolds - j));
+        f->numFolds -= j - i - 1;
+    }
+    f->folds[i].start = start;
+    f->folds[i].end = end;
+    foldRecount(i);
+}
+
+void editorFoldClear(){
+    E.folds.numFolds = 0;
+    E.folds.hidden = 0;
+    E.folds.gap = 0;
+    E.folds.shift = 0;
+    E.folds.hiddenShift = 0;
+}
+
+// A row inserted inside a fold, or right under its header, stays folded so the fold keeps its header.
+// One inserted before a fold pushes it and every fold after it down, which is left pending past the gap
+void editorFoldRowInserted(int at){
+    struct foldIndex *f = &E.folds;
+    int i = foldFind(at);
+    if(i == f->numFolds) return; // Appending past every fold, the common case while loading
+    if(foldGet(i).start <= at){
+        foldMoveGap(i + 1);
+        f->folds[i].end++;
+        f->hidden++;
+        f->hiddenShift++;
+    }else{
+        foldMoveGap(i);
+    }
+    f->shift++;
+}
+
+void editorFoldRowDeleted(int at){
+    struct foldIndex *f = &E.folds;
+    int i = foldFind(at);
+    if(i == f->numFolds) return;
+    struct fold fold = foldGet(i);
+    if(fold.start == at + 1 || (fold.start == at && fold.end == at)){
+        editorFoldRemove(i); // Its header row is going, or its last row
+        foldMoveGap(i);
+    }else if(fold.start <= at){
+        foldMoveGap(i + 1);
+        f->folds[i].end--;
+        f->hidden--;
+        f->hiddenShift--;
+    }else{
+        foldMoveGap(i);
+    }
+    f->shift--;
+}
+
+// Width of a row's indentation, -1 for a blank row
+static int foldIndent(erow *row){
+    int width = 0;
+    for(int j = 0; j < row->size; j++){
+        if(row->chars[j] == ' ') width++;
+        else if(row->chars[j] == '\t') width += TAB_STOPS - width % TAB_STOPS;
+        else return width;
+    }
+    return -1;
+}
+
+// Last row of the block a row heads by indentation: the rows after it that are indented deeper, and the
+// blank rows between them
+static int foldIndentEnd(int y){
+    int level = foldIndent(&E.row[y]);
+    if(level == -1) return y;
+    int end = y;
+    for(int r = y + 1; r < E.numRows; r++){
+        int indent = foldIndent(&E.row[r]);
+        if(indent == -1) continue;
+        if(indent <= level) break;
+        end = r;
+    }
+    return end;
+}
+
+// Last row inside the brackets left open at the end of row y, or -1. The closing bracket's row stays visible
+static int foldBracketEnd(int y){
+    erow *row = &E.row[y];
+    editorRowHighlight(row);
+    int depth = 0;
+    for(int j = row->rsize - 1; j >= 0; j--){
+        if(!isCodeBracket(row, j)) continue;
+        if(isCloseBracket(row->render[j])){
+            depth++;
+        }else if(depth > 0){
+            depth--;
+        }else{
+            int my, mat;
+            if(!editorFindBracketMatch(y, j, &my, &mat) || my <= y + 1) return -1;
+            return my - 1;
+        }
+    }
+    return -1;
+}
+
+// Ctrl-K: folds the block the cursor row opens, by brackets or else by indentation, or unfolds it again
+void editorFoldToggle(){
+    if(E.cy >= E.numRows) return;
+    int i = editorFoldAt(E.cy + 1);
+    if(i != -1){
+        int start, end;
+        editorFoldRange(i, &start, &end);
+        int rows = end - start + 1;
+        editorFoldRemove(i);
+        editorSetStatusMessage("Unfolded %d lines", rows);
+        return;
+    }
+    int end = foldBracketEnd(E.cy);
+    if(end == -1) end = foldIndentEnd(E.cy);
+    if(end <= E.cy){
+        editorSetStatusMessage("Nothing to fold here");
+        return;
+    }
+    foldAdd(E.cy + 1, end);
+    editorSetStatusMessage("Folded %d lines", end - E.cy);
+}
+
+// Ctrl-Y: folds every block at the cursor row's indentation in one pass over the rows, or unfolds everything
+void editorFoldAll(){
+    if(E.folds.numFolds){
+        editorFoldClear();
+        editorSetStatusMessage("Unfolded everything");
+        return;
+    }
+    int level = E.cy < E.numRows ? foldIndent(&E.row[E.cy]) : 0;
+    if(level == -1) level = 0;
+    struct foldIndex *f = &E.folds;
+    editorFoldClear(); // Drops a shift left pending past the last fold
+    for(int i = 0; i < E.numRows;){
+        if(foldIndent(&E.row[i]) != level){
+            i++;
+            continue;
+        }
+        int end = i, r = i + 1;
+        for(; r < E.numRows; r++){
+            int indent = foldIndent(&E.row[r]);
+            if(indent == -1) continue;
+            if(indent <= level) break;
+            end = r;
+        }
+        if(end > i){ // Blocks come out in order, append them as they are
+            if(f->numFolds == f->cap){
+                f->cap = f->cap ? f->cap * 2 : 16;
+                f->folds = realloc(f->folds, sizeof(struct fold) * f->cap);
+            }
+            f->folds[f->numFolds++] = (struct fold){i + 1, end, 0};
+        }
+        i = r;
+    }
+    foldRecount(0);
+    editorSetStatusMessage("Folded %d blocks, %d lines hidden", f->numFolds, f->hidden);
+}
+
+/*** Soft wrap ***/
+// Works out where a row breaks into screen lines, only when it is drawn or the cursor crosses it and only
+// again once the row or the screen width changes. Plain rows break every screenCols bytes, nothing to store
+static void wrapRow(erow *row){
+    int width = E.screenCols > 0 ? E.screenCols : 1;
+    if(row->wrapWidth == width) return;
+    free(row->wrapStarts);
+    row->wrapStarts = NULL;
+    row->wrapWidth = width;
+    if(editorRowIsPlain(row)){
+        row->wrapCount = row->rsize / width + 1; // A full last line gets an empty one after it for the cursor
+        return;
+    }
+
+    // Otherwise char by char, so tabs and wide chars are never split across lines
+    int cap = 4;
+    row->wrapStarts = malloc(sizeof(struct wrapPoint) * cap);
+    row->wrapStarts[0] = (struct wrapPoint){0, 0};
+    int count = 1, col = 0, rx = 0, rbyte = 0;
+    for(int cx = 0; cx <= row->size;){
+        int nextRx = rx, nextRbyte = rbyte, n = 1;
+        if(cx < row->size) n = editorRowStep(row, cx, &nextRx, &nextRbyte);
+        else nextRx++; // Past the end is where the cursor goes, one column
+        if(col + nextRx - rx > width && col > 0){
+            if(count == cap){
+                cap *= 2;
+                row->wrapStarts = realloc(row->wrapStarts, sizeof(struct wrapPoint) * cap);
+            }
+            row->wrapStarts[count++] = (struct wrapPoint){rbyte, rx};
+            col = 0;
+        }
+        col += nextRx - rx;
+        rx = nextRx;
+        rbyte = nextRbyte;
+        cx += n;
+    }
+    row->wrapCount = count;
+}
+
+int editorRowWrapCount(erow *row){
+    wrapRow(row);
+    return row->wrapCount;
+}
+
+// Render offset and column screen line `line` of row starts at
+static void wrapLineStart(erow *row, int line, int *rbyte, int *rx){
+    wrapRow(row);
+    if(row->wrapStarts){
+        *rbyte = row->wrapStarts[line].rbyte;
+        *rx = row->wrapStarts[line].rx;
+    }else{
+        *rx = line * row->wrapWidth;
+        *rbyte = *rx < row->rsize ? *rx : row->rsize;
+    }
+}
+
+// Screen line of row that column rx is on
+static int wrapLineOf(erow *row, int rx){
+    wrapRow(row);
+    int lo = 0, hi = row->wrapCount - 1;
+    if(!row->wrapStarts){
+        lo = rx / row->wrapWidth;
+        return lo < hi ? lo : hi;
+    }
+    while(lo < hi){
+        int mid = (lo + hi + 1) / 2;
+        if(row->wrapStarts[mid].rx <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Moves a (row, screen line of the row) position one screen line up or down, over folds. Returns 0 at either
+// end of the file. The row after the last one has a single line, for the cursor
+static int wrapStep(int *row, int *line, int dir){
+    if(dir < 0){
+        if(*line > 0){
+            (*line)--;
+            return 1;
+        }
+        if(*row <= 0) return 0;
+        *row = editorPrevVisible(*row);
+        *line = editorRowWrapCount(&E.row[*row]) - 1;
+        return 1;
+    }
+    if(*row >= E.numRows) return 0;
+    if(*line < editorRowWrapCount(&E.row[*row]) - 1){
+        (*line)++;
+        return 1;
+    }
+    *row = editorNextVisible(*row);
+    *line = 0;
+    return 1;
+}
+
+// Screen line of the cursor's row the cursor is on, and its column on that line
+static void wrapCursor(int *line, int *col){
+    *line = *col = 0;
+    if(E.cy >= E.numRows) return;
+    erow *row = &E.row[E.cy];
+    int rx = editorRowCxToRx(row, E.cx), rbyte, startRx;
+    *line = wrapLineOf(row, rx);
+    wrapLineStart(row, *line, &rbyte, &startRx);
+    *col = rx - startRx;
+}
+
+// Keeps the cursor on screen by screen lines. Only the lines between the top of the screen and the
+// cursor are looked at, never the whole file
+void editorWrapScroll(){
+    E.colOffset = 0;
+    if(E.rowOffset >= E.numRows) E.wrapOffset = 0;
+    else if(E.wrapOffset >= editorRowWrapCount(&E.row[E.rowOffset])) E.wrapOffset = E.row[E.rowOffset].wrapCount - 1;
+
+    int line, col;
+    wrapCursor(&line, &col);
+    if(E.cy < E.rowOffset || (E.cy == E.rowOffset && line < E.wrapOffset)){
+        E.rowOffset = E.cy;
+        E.wrapOffset = line;
+        return;
+    }
+    // Walk up a screen from the cursor, if the top of the screen isn't on the way the cursor is below the screen
+    int r = E.cy, l = line;
+    int found = r == E.rowOffset && l == E.wrapOffset;
+    for(int n = 1; n < E.screenRows && !found && wrapStep(&r, &l, -1); n++) found = r == E.rowOffset && l == E.wrapOffset;
+    if(!found){
+        E.rowOffset = r;
+        E.wrapOffset = l;
+    }
+}
+
+// Where the cursor is on the screen, after editorWrapScroll
+void editorWrapCursorScreen(int *y, int *x){
+    int line;
+    wrapCursor(&line, x);
+    int r = E.rowOffset, l = E.wrapOffset;
+    for(*y = 0; *y < E.screenRows && !(r == E.cy && l == line) && wrapStep(&r, &l, 1);) (*y)++;
+}
+
+// Next screen line to draw after (row, line)
+void editorWrapNextLine(int *row, int *line){
+    if(E.softWrap && *row < E.numRows) wrapStep(row, line, 1);
+    else *row = editorNextVisible(*row);
+}
+
+// Moves the cursor one screen line up or down, staying in the same column where the line is long enough
+void editorWrapMove(int dir){
+    int line, col;
+    wrapCursor(&line, &col);
+    int r = E.cy;
+    if(!wrapStep(&r, &line, dir)) return;
+    E.cy = r;
+    if(r >= E.numRows){
+        E.cx = 0;
+        return;
+    }
+    erow *row = &E.row[r];
+    int rbyte, rx;
+    wrapLineStart(row, line, &rbyte, &rx);
+    rx += col;
+    if(line + 1 < row->wrapCount){ // Not past the end of this line onto the next
+        int nextRbyte, nextRx;
+        wrapLineStart(row, line + 1, &nextRbyte, &nextRx);
+        if(rx >= nextRx) rx = nextRx - 1;
+    }
+    E.cx = editorRowRxToCx(row, rx);
+}
+
+// Ctrl-W
+void editorSoftWrapToggle(){
+    E.softWrap = !E.softWrap;
+    E.wrapOffset = 0;
+    E.colOffset = 0;
+    editorSetStatusMessage(E.softWrap ? "Soft wrap on" : "Soft wrap off");
+}
+
+/*** Word completion ***/
+int isWordChar(int c){
+    c = (unsigned char)c;
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+static void wordsQueue(char **buf, size_t *len, size_t *cap, const char *s, int n){
+    if(*len + n + 1 > *cap){
+        *cap = (*len + n + 1) * 2;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(&(*buf)[*len], s, n);
+    (*buf)[*len + n] = '\n';
+    *len += n + 1;
+}
+
+// Called with a row's render before and after a change. Only the stretch that differs, widened to
+// whole words, is handed to the worker, so typing on a long line doesn't re-index all of it
+void editorWordsRowChanged(const char *old, int oldLen, const char *new, int newLen){
+    struct editorWords *w = E.words;
+    if(!w) return;
+
+    int shorter = oldLen < newLen ? oldLen : newLen;
+    int prefix = 0;
+    while(prefix < shorter && old[prefix] == new[prefix]) prefix++;
+    int suffix = 0;
+    while(suffix < shorter - prefix && old[oldLen - 1 - suffix] == new[newLen - 1 - suffix]) suffix++;
+    while(prefix > 0 && isWordChar(new[prefix - 1])) prefix--;
+    while(suffix > 0 && isWordChar(new[newLen - suffix])) suffix--;
+    if(prefix + suffix >= oldLen && prefix + suffix >= newLen) return; // Nothing a word could have changed in
+
+    pthread_mutex_lock(&w->lock);
+    int wasEmpty = w->addedLen == 0 && w->removedLen == 0;
+    if(oldLen - prefix - suffix > 0) wordsQueue(&w->removed, &w->removedLen, &w->removedCap, &old[prefix], oldLen - prefix - suffix);
+    if(newLen - prefix - suffix > 0) wordsQueue(&w->added, &w->addedLen, &w->addedCap, &new[prefix], newLen - prefix - suffix);
+    pthread_mutex_unlock(&w->lock);
+    if(wasEmpty) pthread_cond_signal(&w->cond);
+}
+
+// Hands the worker a whole file's worth of rows to count, a cache load's rows start out as nothing but
+// pointers into text. It is counted where it is rather than copied into the queue, a slice at a time
+void editorWordsAddBulk(const char *text, size_t len){
+    struct editorWords *w = E.words;
+    if(!w || len == 0) return;
+    pthread_mutex_lock(&w->lock);
+    w->bulk = text;
+    w->bulkLen = len;
+    w->bulkDropped = 0;
+    pthread_mutex_unlock(&w->lock);
+    pthread_cond_signal(&w->cond);
+}
+
+// Called before the text handed to editorWordsAddBulk is freed. Waits for the slice being counted, the
+// rest never gets counted
+void editorWordsDropBulk(){
+    struct editorWords *w = E.words;
+    if(!w) return;
+    pthread_mutex_lock(&w->lock);
+    w->bulkDropped = 1;
+    while(w->bulkBusy) pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// A row that was never loaded is about to go, or to get a render of its own. If its raw bytes are still
+// waiting in the bulk text they are blanked so the worker never counts them, and 1 says there is nothing
+// of the row to take away. 0 means its words were counted already
+int editorWordsClaim(char *chars, int len){
+    struct editorWords *w = E.words;
+    if(!w) return 0;
+    pthread_mutex_lock(&w->lock);
+    int uncounted = chars >= w->bulk && chars < w->bulk + w->bulkLen;
+    if(uncounted) memset(chars, ' ', len);
+    pthread_mutex_unlock(&w->lock);
+    return uncounted;
+}
+
+static uint32_t wordHash(const char *s, int len){
+    uint32_t h = 2166136261u; // FNV-1a
+    for(int i = 0; i < len; i++){
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct wordEntry *wordIntern(struct editorWords *w, const char *s, int len){
+    if((w->tableUsed + 1) * 2 > w->tableCap){
+        size_t cap = w->tableCap ? w->tableCap * 2 : 4096;
+        struct wordEntry **table = calloc(cap, sizeof(struct wordEntry *));
+        for(size_t i = 0; i < w->tableCap; i++){
+            struct wordEntry *e = w->table[i];
+            if(!e) continue;
+            size_t slot = e->hash & (cap - 1);
+            while(table[slot]) slot = (slot + 1) & (cap - 1);
+            table[slot] = e;
+        }
+        free(w->table);
+        w->table = table;
+        w->tableCap = cap;
+    }
+
+    uint32_t hash = wordHash(s, len);
+    size_t slot = hash & (w->tableCap - 1);
+    for(struct wordEntry *e; (e = w->table[slot]); slot = (slot + 1) & (w->tableCap - 1))
+        if(e->hash == hash && e->len == len && !memcmp(e->word, s, len)) return e;
+
+    // New word, copy it into the arena where it stays put for as long as the index lives
+    size_t size = (sizeof(struct wordEntry) + len + 1 + 7) & ~(size_t)7;
+    if(!w->arena || w->arena->used + size > WORDS_ARENA_SIZE){
+        struct wordArena *a = malloc(sizeof(struct wordArena) + WORDS_ARENA_SIZE);
+        a->next = w->arena;
+        a->used = 0;
+        w->arena = a;
+    }
+    struct wordEntry *e = (struct wordEntry *)&w->arena->data[w->arena->used];
+    w->arena->used += size;
+    e->hash = hash;
+    e->len = len;
+    e->count = 0;
+    e->listed = 0;
+    memcpy(e->word, s, len);
+    e->word[len] = '\0';
+    w->table[slot] = e;
+    w->tableUsed++;
+    return e;
+}
+
+// Adds (delta 1) or takes away (delta -1) every word in a block of queued text
+static void wordsCount(struct editorWords *w, const char *s, size_t len, int delta){
+    size_t i = 0;
+    while(i < len){
+        if(!isWordChar(s[i])){
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while(i < len && isWordChar(s[i])) i++;
+        int n = i - start;
+        if(n < WORDS_MIN_LEN || n > WORDS_MAX_LEN || isdigit((unsigned char)s[start])) continue;
+
+        struct wordEntry *e = wordIntern(w, &s[start], n);
+        e->count += delta;
+        if(e->count > 0 && !e->listed){
+            e->listed = 1;
+            if(w->numFresh == w->freshCap){
+                w->freshCap = w->freshCap ? w->freshCap * 2 : 1024;
+                w->fresh = realloc(w->fresh, sizeof(struct wordEntry *) * w->freshCap);
+            }
+            w->fresh[w->numFresh++] = e;
+        }else if(e->count == 0 && e->listed){
+            w->died++;
+        }
+    }
+}
+
+static int wordCompare(const void *a, const void *b){
+    return strcmp((*(struct wordEntry * const *)a)->word, (*(struct wordEntry * const *)b)->word);
+}
+
+// Merges the new words into the published list and drops the dead ones. Only the fresh words get
+// sorted, the rest is a linear merge, and lookups only wait for the pointer swap at the end
+static void wordsPublish(struct editorWords *w){
+    qsort(w->fresh, w->numFresh, sizeof(struct wordEntry *), wordCompare);
+    struct wordEntry **old = w->sorted; // Only the worker replaces the list, so reading it here needs no lock
+    int numOld = w->numSorted;
+    struct wordEntry **merged = malloc(sizeof(struct wordEntry *) * (numOld + w->numFresh + 1));
+    int n = 0, i = 0, j = 0;
+    while(i < numOld || j < w->numFresh){
+        struct wordEntry *e;
+        if(j == w->numFresh || (i < numOld && strcmp(old[i]->word, w->fresh[j]->word) < 0)) e = old[i++];
+        else e = w->fresh[j++];
+        if(e->count > 0) merged[n++] = e;
+        else e->listed = 0;
+    }
+    w->numFresh = 0;
+    w->died = 0;
+
+    pthread_mutex_lock(&w->lock);
+    w->sorted = merged;
+    w->numSorted = n;
+    pthread_mutex_unlock(&w->lock);
+    free(old);
+}
+
+static double wordsNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *wordsWorkerThread(void *arg){
+    struct editorWords *w = arg;
+    char *added = NULL, *removed = NULL;
+    size_t addedCap = 0, removedCap = 0;
+    double lastPublish = 0;
+    while(1){
+        pthread_mutex_lock(&w->lock);
+        while(!w->stop && w->addedLen == 0 && w->removedLen == 0 && (w->bulkDropped || w->bulkLen == 0))
+            pthread_cond_wait(&w->cond, &w->lock);
+        if(w->stop){
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        // Swap buffers with the main thread so it can keep queueing while we count
+        char *tmp = w->added; w->added = added; added = tmp;
+        size_t cap = w->addedCap; w->addedCap = addedCap; addedCap = cap;
+        size_t addedLen = w->addedLen;
+        tmp = w->removed; w->removed = removed; removed = tmp;
+        cap = w->removedCap; w->removedCap = removedCap; removedCap = cap;
+        size_t removedLen = w->removedLen;
+        w->addedLen = w->removedLen = 0;
+        // A slice of the bulk text ends on a row boundary, so a row is either wholly counted or not at all
+        const char *slice = w->bulk;
+        size_t sliceLen = 0;
+        if(!w->bulkDropped && w->bulkLen){
+            sliceLen = w->bulkLen < WORDS_BULK_SLICE ? w->bulkLen : WORDS_BULK_SLICE;
+            const char *nl = memchr(&slice[sliceLen - 1], '\n', w->bulkLen - sliceLen + 1);
+            sliceLen = nl ? (size_t)(nl - slice) + 1 : w->bulkLen;
+            w->bulk += sliceLen;
+            w->bulkLen -= sliceLen;
+            w->bulkBusy = 1;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        // Additions first, whatever gets removed was added before, at the latest in this same batch. Rows
+        // of the bulk text the worker hasn't reached are blanked rather than queued for removal
+        wordsCount(w, added, addedLen, 1);
+        wordsCount(w, slice, sliceLen, 1);
+        wordsCount(w, removed, removedLen, -1);
+        if(sliceLen){
+            pthread_mutex_lock(&w->lock);
+            w->bulkBusy = 0;
+            pthread_cond_broadcast(&w->cond); // editorWordsDropBulk may be waiting for the slice to be done
+            pthread_mutex_unlock(&w->lock);
+        }
+
+        if(w->numFresh == 0 && w->died == 0) continue;
+        pthread_mutex_lock(&w->lock);
+        int idle = w->addedLen == 0 && w->removedLen == 0 && (w->bulkDropped || w->bulkLen == 0);
+        pthread_mutex_unlock(&w->lock);
+        double now = wordsNow();
+        if(idle || now - lastPublish > WORDS_PUBLISH_MS / 1000.0){
+            wordsPublish(w);
+            lastPublish = now;
+        }
+    }
+    free(added);
+    free(removed);
+    return NULL;
+}
+
+void editorWordsStart(){
+    struct editorWords *w = calloc(1, sizeof(*w));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if(pthread_create(&w->worker, NULL, wordsWorkerThread, w) != 0){
+        free(w);
+        return;
+    }
+    E.words = w;
+}
+
+// Up to max live words starting with prefix (but not the prefix itself), in sorted order. A binary
+// search in the published list, so it doesn't depend on how much is still waiting to be indexed
+int editorWordsLookup(const char *prefix, int len, const char **out, int max){
+    struct editorWords *w = E.words;
+    if(!w) return 0;
+    int n = 0;
+    pthread_mutex_lock(&w->lock);
+    int lo = 0, hi = w->numSorted;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(strncmp(w->sorted[mid]->word, prefix, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for(int i = lo; i < w->numSorted && n < max; i++){
+        struct wordEntry *e = w->sorted[i];
+        if(strncmp(e->word, prefix, len)) break;
+        if(e->len > len) out[n++] = e->word; // Interned words never move, safe to use after unlocking
+    }
+    pthread_mutex_unlock(&w->lock);
+    return n;
+}
+
+// Ctrl-N / Ctrl-P: completes the word before the cursor from the rest of the buffer. Pressing it
+// again right away replaces the completion with the next (or previous) candidate, cycling back
+// round to what was typed
+void editorComplete(int dir, int again){
+    struct editorCompletion *c = &E.completion;
+    if(E.cy >= E.numRows) return;
+    erow *row = &E.row[E.cy];
+    if(!again || c->cy != E.cy){
+        int start = E.cx;
+        while(start > 0 && isWordChar(row->chars[start - 1])) start--;
+        c->prefixLen = E.cx - start;
+        if(c->prefixLen == 0 || c->prefixLen > WORDS_MAX_LEN){
+            editorSetStatusMessage("Nothing to complete");
+            return;
+        }
+        c->numCandidates = editorWordsLookup(&row->chars[start], c->prefixLen, c->candidates, COMPLETE_MAX);
+        c->current = -1;
+        c->cy = E.cy;
+        if(c->numCandidates == 0){
+            editorSetStatusMessage("No completions for %.*s", c->prefixLen, &row->chars[start]);
+            return;
+        }
+    }
+
+    // Take back what the last candidate added, then type in the rest of the next one
+    if(c->current >= 0)
+        for(int i = c->prefixLen; i < (int)strlen(c->candidates[c->current]); i++) editorDeleteChar();
+    c->current += dir;
+    if(c->current >= c->numCandidates) c->current = -1;
+    else if(c->current < -1) c->current = c->numCandidates - 1;
+    if(c->current >= 0)
+        for(const char *p = c->candidates[c->current] + c->prefixLen; *p; p++) editorInsertChar(*p);
+
+    if(c->current < 0) editorSetStatusMessage("Back at original (%d matches)", c->numCandidates);
+    else editorSetStatusMessage("Match %d of %d%s: %s", c->current + 1, c->numCandidates,
+                                c->numCandidates == COMPLETE_MAX ? "+" : "", c->candidates[c->current]);
+}
+
+/*** Line commands ***/
+// Rows are sorted as pointers with a key next to them, the text never moves. The key is the number
+// the row starts with for a numeric sort, otherwise its first 8 bytes in big endian order so most
+// comparisons never have to follow the pointer
+struct sortItem{
+    erow *row;
+    union {
+        double num;
+        uint64_t prefix;
+    } key;
+};
+
+struct sortJob{
+    struct sortItem *items;
+    struct sortItem *tmp;
+    size_t lo, mid, hi;
+    int numeric;
+    int reverse;
+    const char *pattern; // Filtering: match rows [lo, hi) against pattern into keep
+    unsigned char *keep;
+    int failed; // The thread couldn't compile its own copy of pattern
+};
+
+static int sortCompare(const struct sortItem *a, const struct sortItem *b, int numeric, int reverse){
+    int cmp = 0;
+    if(numeric){
+        // Rows starting with "nan" aren't ordered against any number, they go last either way round
+        int aNan = a->key.num != a->key.num, bNan = b->key.num != b->key.num;
+        if(aNan != bNan) return aNan ? 1 : -1;
+        if(!aNan && a->key.num != b->key.num) cmp = a->key.num < b->key.num ? -1 : 1;
+    }
+    else if(!numeric && a->key.prefix != b->key.prefix) cmp = a->key.prefix < b->key.prefix ? -1 : 1;
+    if(!cmp){
+        int n = a->row->size < b->row->size ? a->row->size : b->row->size;
+        cmp = memcmp(a->row->chars, b->row->chars, n);
+        if(!cmp) cmp = (a->row->size > b->row->size) - (a->row->size < b->row->size);
+    }
+    return reverse ? -cmp : cmp;
+}
+
+// Merges the sorted runs [lo, mid) and [mid, hi) of src into dst. Ties go to the left run, so the sort is stable
+static void sortMerge(struct sortItem *src, struct sortItem *dst, size_t lo, size_t mid, size_t hi, int numeric, int reverse){
+    size_t i = lo, j = mid, k = lo;
+    while(i < mid && j < hi) dst[k++] = sortCompare(&src[j], &src[i], numeric, reverse) < 0 ? src[j++] : src[i++];
+    while(i < mid) dst[k++] = src[i++];
+    while(j < hi) dst[k++] = src[j++];
+}
+
+// Sorts items[lo, hi), using tmp[lo, hi) as scratch space
+static void sortRange(struct sortItem *items, struct sortItem *tmp, size_t lo, size_t hi, int numeric, int reverse){
+    if(hi - lo < 16){
+        for(size_t i = lo + 1; i < hi; i++){
+            struct sortItem x = items[i];
+            size_t j = i;
+            for(; j > lo && sortCompare(&x, &items[j - 1], numeric, reverse) < 0; j--) items[j] = items[j - 1];
+            items[j] = x;
+        }
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    sortRange(items, tmp, lo, mid, numeric, reverse);
+    sortRange(items, tmp, mid, hi, numeric, reverse);
+    if(sortCompare(&items[mid], &items[mid - 1], numeric, reverse) >= 0) return; // Already in order
+    sortMerge(items, tmp, lo, mid, hi, numeric, reverse);
+    memcpy(&items[lo], &tmp[lo], sizeof(struct sortItem) * (hi - lo));
+}
+
+static void *sortChunkThread(void *arg){
+    struct sortJob *job = arg;
+    for(size_t i = job->lo; i < job->hi; i++){
+        erow *row = job->items[i].row;
+        if(job->numeric){
+            job->items[i].key.num = strtod(row->chars, NULL);
+        }else{
+            uint64_t prefix = 0; // Zero padded, which sorts a short row before a longer one it starts
+            for(int j = 0; j < 8; j++) prefix = prefix << 8 | (j < row->size ? (unsigned char)row->chars[j] : 0);
+            job->items[i].key.prefix = prefix;
+        }
+    }
+    sortRange(job->items, job->tmp, job->lo, job->hi, job->numeric, job->reverse);
+    return NULL;
+}
+
+static void *sortMergeThread(void *arg){
+    struct sortJob *job = arg;
+    sortMerge(job->items, job->tmp, job->lo, job->mid, job->hi, job->numeric, job->reverse);
+    return NULL;
+}
+
+// Each thread compiles the pattern for itself, glibc locks a compiled regex_t for the length of a regexec
+// so sharing one would run the threads one at a time
+static void *filterThread(void *arg){
+    struct sortJob *job = arg;
+    regex_t re;
+    job->failed = regcomp(&re, job->pattern, REG_EXTENDED | REG_NOSUB) != 0; // Only out of memory, it compiled on the main thread
+    if(job->failed) return NULL;
+    for(size_t i = job->lo; i < job->hi; i++){
+        erow *row = job->items[i].row;
+        job->keep[i] = regexec(&re, row->chars, 0, NULL, 0) == 0;
+    }
+    regfree(&re);
+    return NULL;
+}
+
+static int linesThreads(size_t n){
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1) threads = 1;
+    if(threads > LINES_MAX_THREADS) threads = LINES_MAX_THREADS;
+    if((size_t)threads > n / LINES_MIN_PER_THREAD) threads = n / LINES_MIN_PER_THREAD;
+    return threads > 1 ? threads : 1;
+}
+
+// Runs fn over `threads` equal slices of [0, n), on the calling thread when there is only one
+static void linesRunParallel(void *(*fn)(void *), struct sortJob *proto, size_t n, int threads, struct sortJob *jobs){
+    pthread_t workers[LINES_MAX_THREADS];
+    int started[LINES_MAX_THREADS] = {0};
+    for(int t = 0; t < threads; t++){
+        jobs[t] = *proto;
+        jobs[t].lo = n * t / threads;
+        jobs[t].hi = n * (t + 1) / threads;
+        if(t > 0) started[t] = pthread_create(&workers[t], NULL, fn, &jobs[t]) == 0;
+    }
+    fn(&jobs[0]);
+    for(int t = 1; t < threads; t++){
+        if(started[t]) pthread_join(workers[t], NULL);
+        else fn(&jobs[t]); // Couldn't get a thread, do it here
+    }
+}
+
+// Sorts rows [from, to). Each thread sorts a slice, then the slices are merged pairwise, the merges of
+// a round also running in parallel. Only the erow structs get moved, in place, by following the cycles
+// of the permutation
+static void linesSort(int from, int to, int numeric, int reverse){
+    size_t n = to - from;
+    struct sortItem *items = malloc(sizeof(struct sortItem) * n);
+    struct sortItem *tmp = malloc(sizeof(struct sortItem) * n);
+    for(size_t i = 0; i < n; i++) items[i].row = &E.row[from + i];
+
+    int threads = linesThreads(n);
+    struct sortJob proto = {items, tmp, 0, 0, 0, numeric, reverse, NULL, NULL, 0};
+    struct sortJob jobs[LINES_MAX_THREADS];
+    linesRunParallel(sortChunkThread, &proto, n, threads, jobs);
+
+    size_t bounds[LINES_MAX_THREADS + 1];
+    for(int t = 0; t <= threads; t++) bounds[t] = n * t / threads;
+    for(int runs = threads; runs > 1; runs = (runs + 1) / 2){
+        pthread_t workers[LINES_MAX_THREADS];
+        int started[LINES_MAX_THREADS] = {0};
+        int merges = runs / 2;
+        for(int m = 0; m < merges; m++){
+            jobs[m] = proto;
+            jobs[m].lo = bounds[2 * m];
+            jobs[m].mid = bounds[2 * m + 1];
+            jobs[m].hi = bounds[2 * m + 2];
+            started[m] = m > 0 && pthread_create(&workers[m], NULL, sortMergeThread, &jobs[m]) == 0;
+            if(m > 0 && !started[m]) sortMergeThread(&jobs[m]);
+        }
+        if(merges) sortMergeThread(&jobs[0]);
+        if(runs % 2) memcpy(&tmp[bounds[runs - 1]], &items[bounds[runs - 1]], sizeof(struct sortItem) * (n - bounds[runs - 1]));
+        for(int m = 1; m < merges; m++) if(started[m]) pthread_join(workers[m], NULL);
+        for(int r = 0; r < (runs + 1) / 2; r++) bounds[r] = bounds[r * 2];
+        bounds[(runs + 1) / 2] = n;
+        struct sortItem *swap = items; items = tmp; tmp = swap;
+        proto.items = items;
+        proto.tmp = tmp;
+    }
+    free(tmp);
+
+    // perm[k] is the row that ends up at from + k, reusing the items array. Each cycle is walked once
+    int *perm = (int *)items;
+    for(size_t k = 0; k < n; k++) perm[k] = items[k].row - &E.row[from];
+    for(size_t k = 0; k < n; k++){
+        if(perm[k] == (int)k) continue;
+        erow held = E.row[from + k];
+        size_t j = k;
+        while(perm[j] != (int)k){
+            size_t next = perm[j];
+            E.row[from + j] = E.row[from + next];
+            perm[j] = j;
+            j = next;
+        }
+        E.row[from + j] = held;
+        perm[j] = j;
+    }
+    free(items);
+}
+
+// Drops rows in [from, to) for which drop[i - from] is set, freeing them and closing the gaps in one pass
+static int linesCompact(int from, int to, const unsigned char *drop){
+    int out = from;
+    for(int i = from; i < to; i++){
+        if(drop[i - from]){
+            E.offsets.totalBytes -= E.row[i].savedLen;
+            editorFreeRow(&E.row[i]);
+        }else{
+            E.row[out++] = E.row[i];
+        }
+    }
+    int removed = to - out;
+    memmove(&E.row[out], &E.row[to], sizeof(erow) * (E.numRows - to));
+    E.numRows -= removed;
+    return removed;
+}
+
+// Keeps (or with drop, removes) the rows in [from, to) that match the regular expression
+static int linesFilter(int from, int to, const char *pattern, int drop){
+    regex_t re;
+    int err = regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB);
+    if(err){
+        char msg[80];
+        regerror(err, &re, msg, sizeof(msg));
+        editorSetStatusMessage("Bad pattern: %s", msg);
+        return -1;
+    }
+    regfree(&re);
+    size_t n = to - from;
+    struct sortItem *items = malloc(sizeof(struct sortItem) * (n ? n : 1));
+    unsigned char *keep = malloc(n ? n : 1);
+    for(size_t i = 0; i < n; i++) items[i].row = &E.row[from + i];
+    struct sortJob proto = {items, NULL, 0, 0, 0, 0, 0, pattern, keep, 0};
+    struct sortJob jobs[LINES_MAX_THREADS];
+    int threads = linesThreads(n);
+    linesRunParallel(filterThread, &proto, n, threads, jobs);
+    free(items);
+    for(int t = 0; t < threads; t++){
+        if(!jobs[t].failed) continue;
+        editorSetStatusMessage("Out of memory compiling the pattern");
+        free(keep);
+        return -1;
+    }
+
+    for(size_t i = 0; i < n; i++) keep[i] = keep[i] == drop; // Now set for the rows to remove
+    int removed = linesCompact(from, to, keep);
+    free(keep);
+    return removed;
+}
+
+// Removes rows in [from, to) that are the same as the row before them
+static int linesUnique(int from, int to){
+    size_t n = to - from;
+    unsigned char *drop = calloc(n ? n : 1, 1);
+    for(int i = from + 1; i < to; i++)
+        drop[i - from] = E.row[i].size == E.row[i - 1].size && !memcmp(E.row[i].chars, E.row[i - 1].chars, E.row[i].size);
+    int removed = linesCompact(from, to, drop);
+    free(drop);
+    return removed;
+}
+
+// Runs a command over every line, or over lines a to b with an "a,b " prefix:
+// sort [-n] [-r], uniq, keep <regex>, drop <regex>
+void editorRunLineCommand(const char *cmd){
+    int from = 0, to = E.numRows;
+    const char *p = cmd;
+    int a, b, used;
+    if(sscanf(p, "%d,%d %n", &a, &b, &used) == 2){
+        from = a > 0 ? a - 1 : 0;
+        to = b < E.numRows ? b : E.numRows;
+        p += used;
+    }
+    if(from >= to){
+        editorSetStatusMessage("No lines in that range");
+        return;
+    }
+
+    // The workers need chars '\0' terminated, and every row in the range gets highlighted below anyway
+    for(int i = from; i < to; i++) editorRowLoad(&E.row[i]);
+
+    int before = E.numRows;
+    int changed = 1;
+    if(!strncmp(p, "sort", 4) && (p[4] == '\0' || p[4] == ' ')){
+        int numeric = 0, reverse = 0, bad = 0;
+        for(const char *opt = p + 4; *opt; opt++){
+            if(*opt == ' ' || *opt == '-') continue;
+            if(*opt == 'n') numeric = 1;
+            else if(*opt == 'r') reverse = 1;
+            else bad = 1;
+        }
+        if(bad){
+            editorSetStatusMessage("sort takes -n and -r");
+            changed = 0;
+        }else{
+            linesSort(from, to, numeric, reverse);
+        }
+    }else if(!strcmp(p, "uniq")){
+        linesUnique(from, to);
+    }else if(!strncmp(p, "keep ", 5) || !strncmp(p, "drop ", 5)){
+        changed = linesFilter(from, to, p + 5, p[0] == 'd') != -1;
+    }else{
+        editorSetStatusMessage("Unknown command: %s", p);
+        changed = 0;
+    }
+    if(!changed) return;
+
+    // Everything below from moved, fix up what depends on row positions once for all of them
+    for(int i = from; i < E.numRows; i++) E.row[i].idx = i;
+    editorFoldClear();
+    E.offsets.dirty = 1;
+    if(E.brackets) E.brackets->dirty = 1;
+    int end = to - (before - E.numRows);
+    for(int i = from; i < end; i++) editorHighlightRow(&E.row[i]);
+    if(end < E.numRows) editorUpdateSyntax(&E.row[end]); // Carries a changed comment state on past the range
+    if(E.cy > E.numRows) E.cy = E.numRows;
+    editorSnapCursor(); // The row now under the cursor can be shorter than the one it was on
+    E.dirty++;
+    editorJournalCompact(1); // Reordering isn't something the journal records, start it over from here
+    editorSetStatusMessage("%d lines, %d removed", end - from, before - E.numRows);
+}
+
+// Ctrl-E
+void editorLineCommand(){
+    char *cmd = editorPrompt("Lines: %s (sort [-n] [-r], uniq, keep RE, drop RE; prefix a,b for a range)", NULL);
+    if(!cmd) return;
+    editorRunLineCommand(cmd);
+    free(cmd);
+}
+
+/*** File Input/Output  ***/
+char *editorRowsToString(size_t *bufLen){
+    size_t totalLen = E.offsets.totalBytes; // Every row's length + 1 for the \n, kept up to date by the row operations
+    *bufLen = totalLen; // Store the length of the file in bufLen
+
+    char *buf = malloc(totalLen); // Store enough spcae for the whole file
+    char *p = buf; // Get a pointer that points to the beginning of the file
+    for(int j = 0; j < E.numRows; j++){
+        memcpy(p, E.row[j].chars, E.row[j].size); // Copy the current line to the pointer 
+        p += E.row[j].size; // Move the pointer to the end of the current line
+        *p =  '\n'; // Add a new line character
+        p++; // Move the pointer one spot past the new line to be ready for the next line
+    }
+
+    return buf;
+}
+
+// Remembers the file the rows were loaded from (or saved to), so the next save can copy the rows
+// that haven't changed straight from it instead of through a buffer
+void editorSaveSourceSet(int fd){
+    if(E.saveSource != -1) close(E.saveSource);
+    E.saveSource = dup(fd);
+    if(E.saveSource != -1 && fstat(E.saveSource, &E.saveSourceStat) == -1){
+        close(E.saveSource);
+        E.saveSource = -1;
+    }
+}
+
+// A row can be copied from the file on save if the file holds exactly its chars and one '\n'
+void editorRowSetOrigin(erow *row, long long off, const char *raw, int rawLen){
+    row->origOff = (row->size == rawLen - 1 && raw[rawLen - 1] == '\n') ? off : -1;
+}
+
+// After a save every row is in the new file exactly where the line offsets say
+static void editorSaveDone(long long len){
+    E.dirty = 0;
+    E.loadedBytes = len;
+    E.loadedPartial = 0;
+    free(E.lineLens);
+    E.lineLens = NULL;
+    E.numLineLens = 0;
+    if(len >= CACHE_MIN_SIZE){ // Every row now ends in exactly one '\n'
+        E.lineLens = malloc(sizeof(uint32_t) * (E.numRows ? E.numRows : 1));
+        for(int j = 0; j < E.numRows; j++) E.lineLens[j] = E.row[j].size + 1;
+        E.numLineLens = E.numRows;
+    }
+    long long off = 0;
+    for(int j = 0; j < E.numRows; j++){
+        E.row[j].origOff = E.saveSource != -1 ? off : -1;
+        off += E.row[j].size + 1;
+    }
+    editorCacheSave();
+    if(E.journal) editorJournalCompact(0); // The saved file is the new base, restart the journal from it
+    else editorJournalOpen(0);
+}
+
+static int saveWriteAt(int fd, const char *buf, size_t len, long long off){
+    while(len > 0){
+        ssize_t n = pwrite(fd, buf, len, off);
+        if(n == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// Copies len bytes at off in the source to the end of out. copy_file_range lets the kernel (or the
+// filesystem, as a reflink) move the data without it coming into user space, sendfile and plain
+// reads are the fallbacks for kernels and filesystems that can't
+static int saveCopyRange(int in, long long off, int out, long long len){
+    while(len > 0 && !E.noCopyFileRange){
+        loff_t inOff = off;
+        ssize_t n = copy_file_range(in, &inOff, out, NULL, len, 0);
+        if(n > 0){
+            off += n;
+            len -= n;
+        }else if(n == -1 && errno == EINTR){
+            continue;
+        }else if(n == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)){
+            E.noCopyFileRange = 1;
+        }else{
+            if(n == 0) errno = EIO; // The file got shorter under us
+            return -1;
+        }
+    }
+    while(len > 0){
+        off_t inOff = off;
+        ssize_t n = sendfile(out, in, &inOff, len);
+        if(n > 0){
+            off += n;
+            len -= n;
+        }else if(n == -1 && errno == EINTR){
+            continue;
+        }else if(n == -1 && (errno == ENOSYS || errno == EINVAL)){
+            break;
+        }else{
+            if(n == 0) errno = EIO;
+            return -1;
+        }
+    }
+    char buf[1 << 16];
+    while(len > 0){
+        ssize_t n = pread(in, buf, len < (long long)sizeof(buf) ? len : (long long)sizeof(buf), off);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0){
+            if(n == 0) errno = EIO;
+            return -1;
+        }
+        if(journalWriteAll(out, buf, n) == -1) return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// When every unchanged row would land exactly where it already is (edits that keep the length of
+// their rows, rows added or removed at the end), only the edited rows are written, into the file
+// itself. Only for when a new file can't be renamed over the old one: like the plain full write, a
+// crash or a full disk halfway leaves the file part old and part new. The swap file is only restarted
+// after the save succeeds, so the edits can still be recovered from it
+static int saveInPlace(long long *copied){
+    int fd = open(E.filename, O_RDWR);
+    if(fd == -1) return -1;
+    char *edited = malloc(SAVE_BUFFER_SIZE);
+    size_t editedLen = 0;
+    long long editedAt = 0, off = 0;
+    int failed = 0;
+    for(int j = 0; j < E.numRows && !failed; j++){
+        erow *row = &E.row[j];
+        if(row->origOff != -1){
+            *copied += row->size + 1;
+        }else{
+            // Edited rows next to each other go out in one write
+            if(editedLen && (editedAt + (long long)editedLen != off || editedLen + row->size + 1 > SAVE_BUFFER_SIZE)){
+                failed = saveWriteAt(fd, edited, editedLen, editedAt) == -1;
+                editedLen = 0;
+            }
+            if(row->size + 1 > SAVE_BUFFER_SIZE){
+                if(!failed) failed = saveWriteAt(fd, row->chars, row->size, off) == -1 || saveWriteAt(fd, "\n", 1, off + row->size) == -1;
+            }else{
+                if(!editedLen) editedAt = off;
+                memcpy(&edited[editedLen], row->chars, row->size);
+                edited[editedLen + row->size] = '\n';
+                editedLen += row->size + 1;
+            }
+        }
+        off += row->size + 1;
+    }
+    if(!failed && editedLen) failed = saveWriteAt(fd, edited, editedLen, editedAt) == -1;
+    free(edited);
+    if(!failed && off != E.saveSourceStat.st_size) failed = ftruncate(fd, off) == -1;
+    if(failed){
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    editorSaveSourceSet(fd);
+    close(fd);
+    return 1;
+}
+
+// Extended attributes, ACLs among them, carried over to the new file that replaces the old one
+static int saveCopyXattrs(int from, int to){
+    ssize_t len = flistxattr(from, NULL, 0);
+    if(len == -1) return errno == ENOTSUP ? 0 : -1;
+    if(len == 0) return 0;
+    char *names = malloc(len);
+    len = flistxattr(from, names, len);
+    int failed = len == -1;
+    for(char *name = names; !failed && name < names + len; name += strlen(name) + 1){
+        ssize_t size = fgetxattr(from, name, NULL, 0);
+        char *value = size > 0 ? malloc(size) : NULL;
+        if(size > 0) size = fgetxattr(from, name, value, size);
+        failed = size == -1 || fsetxattr(to, name, value, size, 0) == -1;
+        free(value);
+    }
+    free(names);
+    return failed ? -1 : 0;
+}
+
+// Saves without passing unchanged rows through user space. A new file is built next to the old one:
+// runs of unchanged rows are copied from the old file by the kernel, edited rows are written from here,
+// and the new file is renamed over the old, so a failure halfway leaves the old file as it was. If a new
+// file can't stand in for the old one and the unchanged rows all stay where they are, only the edited
+// rows are written into the old file (saveInPlace). Returns 1 when saved, 0 when neither applies (nothing
+// to copy from, the file changed on disk, no new file possible and rows moved) and the caller should
+// write the whole buffer, -1 on an I/O error
+int editorSaveZeroCopy(long long *copied){
+    *copied = 0;
+    if(E.saveSource == -1) return 0;
+    struct stat st, now;
+    if(lstat(E.filename, &st) == -1 || !S_ISREG(st.st_mode) || st.st_ino != E.saveSourceStat.st_ino ||
+       st.st_dev != E.saveSourceStat.st_dev || fstat(E.saveSource, &now) == -1 ||
+       now.st_size != E.saveSourceStat.st_size || now.st_mtim.tv_sec != E.saveSourceStat.st_mtim.tv_sec ||
+       now.st_mtim.tv_nsec != E.saveSourceStat.st_mtim.tv_nsec)
+        return 0; // Renamed, replaced, a symlink or written to since we read it, copying from it isn't safe
+    int any = 0, inPlace = 1;
+    long long off = 0;
+    for(int j = 0; j < E.numRows; j++){
+        if(E.row[j].origOff != -1){
+            any = 1;
+            if(E.row[j].origOff != off) inPlace = 0;
+        }
+        off += E.row[j].size + 1;
+    }
+    if(!any) return 0;
+    if(st.st_nlink > 1) return inPlace ? saveInPlace(copied) : 0; // Renaming over it would split it from its other names
+
+    // The new file has to end up as the old one was: a read-only directory, or an owner or attributes
+    // we can't give it, mean writing into the old file instead
+    size_t nameLen = strlen(E.filename);
+    char *tmp = malloc(nameLen + 16);
+    snprintf(tmp, nameLen + 16, "%s.saveXXXXXX", E.filename);
+    int fd = mkstemp(tmp);
+    if(fd == -1){
+        free(tmp);
+        return inPlace ? saveInPlace(copied) : 0;
+    }
+    if(fchown(fd, st.st_uid, st.st_gid) == -1 || fchmod(fd, st.st_mode & 07777) == -1 ||
+       saveCopyXattrs(E.saveSource, fd) == -1){
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return inPlace ? saveInPlace(copied) : 0;
+    }
+
+    char *edited = malloc(SAVE_BUFFER_SIZE); // Edited rows waiting to be written, flushed before each copy
+    size_t editedLen = 0;
+    int failed = 0;
+    for(int j = 0; j < E.numRows && !failed;){
+        erow *row = &E.row[j];
+        if(row->origOff == -1){
+            if(editedLen + row->size + 1 > SAVE_BUFFER_SIZE){
+                failed = journalWriteAll(fd, edited, editedLen) == -1;
+                editedLen = 0;
+            }
+            if(row->size + 1 > SAVE_BUFFER_SIZE){ // Too long to buffer, straight out
+                if(!failed) failed = journalWriteAll(fd, row->chars, row->size) == -1 || journalWriteAll(fd, "\n", 1) == -1;
+            }else{
+                memcpy(&edited[editedLen], row->chars, row->size);
+                edited[editedLen + row->size] = '\n';
+                editedLen += row->size + 1;
+            }
+            j++;
+            continue;
+        }
+
+        // The longest stretch of rows that are also next to each other in the old file
+        long long start = row->origOff, len = 0;
+        for(; j < E.numRows && E.row[j].origOff == start + len; j++) len += E.row[j].size + 1;
+        if(editedLen){
+            failed = journalWriteAll(fd, edited, editedLen) == -1;
+            editedLen = 0;
+        }
+        if(!failed) failed = saveCopyRange(E.saveSource, start, fd, len) == -1;
+        *copied += len;
+    }
+    if(!failed && editedLen) failed = journalWriteAll(fd, edited, editedLen) == -1;
+    free(edited);
+    if(!failed) failed = fsync(fd) == -1 || rename(tmp, E.filename) == -1;
+
+    if(failed){
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+    editorSaveSourceSet(fd);
+    close(fd);
+    free(tmp);
+    return 1;
+}
+
+// Compression picked by a new file's name when it's saved as foo.gz or foo.zst
+static int compressionFromName(const char *filename){
+    const char *ext = strrchr(filename, '.');
+    if(ext && !strcmp(ext, ".gz")) return COMPRESS_GZIP;
+    if(ext && !strcmp(ext, ".zst")) return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+struct gzipBlock{
+    const unsigned char *in; // The dictLen bytes before in are the text just before it
+    int inLen;
+    int dictLen;
+    int last;
+    unsigned char *out;
+    int outLen;
+    uLong crc;
+    int failed;
+};
+
+static void *gzipBlockThread(void *arg){
+    struct gzipBlock *b = arg;
+    b->crc = crc32(0L, b->in, b->inLen);
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){ // Raw deflate, the gzip wrapper is written once around all blocks
+        b->failed = 1;
+        return NULL;
+    }
+    if(b->dictLen) deflateSetDictionary(&z, b->in - b->dictLen, b->dictLen);
+    uLong cap = deflateBound(&z, b->inLen) + 16; // Room for the empty block Z_SYNC_FLUSH ends with
+    b->out = malloc(cap);
+    if(b->out){
+        z.next_in = (Bytef *)b->in;
+        z.avail_in = b->inLen;
+        z.next_out = b->out;
+        z.avail_out = cap;
+        int ret = deflate(&z, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+        b->outLen = cap - z.avail_out;
+        b->failed = z.avail_in != 0 || (b->last ? ret != Z_STREAM_END : ret != Z_OK);
+    }else{
+        b->failed = 1;
+    }
+    deflateEnd(&z);
+    return NULL;
+}
+
+// Writes the rows out as one gzip member, compressing GZIP_BLOCK_SIZE blocks on as many threads as there are
+// cores. Every block but the last ends on a byte boundary (Z_SYNC_FLUSH), so their deflate streams just
+// concatenate, and each is primed with the 32K before it so the ratio stays close to plain gzip
+static int saveGzip(int fd, long long *written){
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1) threads = 1;
+    if(threads > LINES_MAX_THREADS) threads = LINES_MAX_THREADS;
+    size_t end = GZIP_WINDOW + (size_t)threads * GZIP_BLOCK_SIZE;
+    unsigned char *buf = malloc(end);
+    if(!buf) return -1;
+
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3}; // No name or mtime, made on Unix
+    int failed = journalWriteAll(fd, (const char *)header, sizeof(header)) == -1;
+    *written = sizeof(header);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    unsigned long long total = 0;
+    size_t dictLen = 0; // Tail of the last round, kept at the start of buf
+    int row = 0, rowOff = 0; // Next byte to gather, rowOff == size is the row's '\n'
+    int done = 0;
+    while(!failed && !done){
+        size_t len = dictLen;
+        while(len < end && row < E.numRows){
+            erow *r = &E.row[row];
+            size_t n = r->size - rowOff;
+            if(n > end - len) n = end - len;
+            memcpy(&buf[len], &r->chars[rowOff], n);
+            len += n;
+            rowOff += n;
+            if(rowOff == r->size && len < end){
+                buf[len++] = '\n';
+                row++;
+                rowOff = 0;
+            }
+        }
+        done = row == E.numRows;
+
+        struct gzipBlock blocks[LINES_MAX_THREADS];
+        pthread_t workers[LINES_MAX_THREADS];
+        int started[LINES_MAX_THREADS] = {0};
+        int numBlocks = (len - dictLen + GZIP_BLOCK_SIZE - 1) / GZIP_BLOCK_SIZE;
+        if(numBlocks == 0) numBlocks = 1; // An empty file still needs a final block
+        for(int b = 0; b < numBlocks; b++){
+            size_t off = dictLen + (size_t)b * GZIP_BLOCK_SIZE;
+            memset(&blocks[b], 0, sizeof(blocks[b]));
+            blocks[b].in = &buf[off];
+            blocks[b].inLen = len - off < GZIP_BLOCK_SIZE ? len - off : GZIP_BLOCK_SIZE;
+            blocks[b].dictLen = off < GZIP_WINDOW ? off : GZIP_WINDOW;
+            blocks[b].last = done && b == numBlocks - 1;
+            if(b > 0) started[b] = pthread_create(&workers[b], NULL, gzipBlockThread, &blocks[b]) == 0;
+        }
+        gzipBlockThread(&blocks[0]);
+        for(int b = 1; b < numBlocks; b++){
+            if(started[b]) pthread_join(workers[b], NULL);
+            else gzipBlockThread(&blocks[b]); // Couldn't get a thread, do it here
+        }
+
+        for(int b = 0; b < numBlocks; b++){
+            if(!failed) failed = blocks[b].failed || journalWriteAll(fd, (const char *)blocks[b].out, blocks[b].outLen) == -1;
+            crc = crc32_combine(crc, blocks[b].crc, blocks[b].inLen);
+            total += blocks[b].inLen;
+            *written += blocks[b].outLen;
+            free(blocks[b].out);
+        }
+
+        // The end of this round primes the first block of the next
+        size_t keep = len < GZIP_WINDOW ? len : GZIP_WINDOW;
+        memmove(buf, &buf[len - keep], keep);
+        dictLen = keep;
+    }
+    free(buf);
+
+    unsigned char trailer[8];
+    for(int i = 0; i < 4; i++){
+        trailer[i] = crc >> (8 * i);
+        trailer[4 + i] = total >> (8 * i); // Length mod 2^32
+    }
+    if(!failed) failed = journalWriteAll(fd, (const char *)trailer, sizeof(trailer)) == -1;
+    *written += sizeof(trailer);
+    if(failed && !errno) errno = EIO;
+    return failed ? -1 : 0;
+}
+
+// Pipes the rows through zstd -T0, which compresses blocks in parallel on its own
+// Runs zstd with the given arguments between in and out. The editor ignores SIGPIPE, zstd gets it back
+// so it stops quietly when its reader goes away. Returns 0 or an errno
+static int spawnZstd(char *argv[], int in, int out, pid_t *child){
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0); // Would scribble over the screen
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    extern char **environ;
+    int err = posix_spawnp(child, "zstd", &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+static int saveZstd(int fd){
+    int pipeFds[2];
+    if(pipe2(pipeFds, O_CLOEXEC) == -1) return -1;
+    char *argv[] = {"zstd", "-q", "-c", "-T0", NULL};
+    pid_t child;
+    int err = spawnZstd(argv, pipeFds[0], fd, &child);
+    close(pipeFds[0]);
+    if(err){
+        close(pipeFds[1]);
+        errno = err;
+        return -1;
+    }
+
+    // SIGPIPE is ignored, so zstd dying shows up as EPIPE here and fails the save
+    char *out = malloc(SAVE_BUFFER_SIZE);
+    size_t outLen = 0;
+    int failed = !out;
+    for(int j = 0; j < E.numRows && !failed; j++){
+        erow *row = &E.row[j];
+        if(outLen + row->size + 1 > SAVE_BUFFER_SIZE){
+            failed = journalWriteAll(pipeFds[1], out, outLen) == -1;
+            outLen = 0;
+        }
+        if(row->size + 1 > SAVE_BUFFER_SIZE){ // Too long to buffer, straight out
+            if(!failed) failed = journalWriteAll(pipeFds[1], row->chars, row->size) == -1 || journalWriteAll(pipeFds[1], "\n", 1) == -1;
+        }else{
+            memcpy(&out[outLen], row->chars, row->size);
+            out[outLen + row->size] = '\n';
+            outLen += row->size + 1;
+        }
+    }
+    if(!failed && outLen) failed = journalWriteAll(pipeFds[1], out, outLen) == -1;
+    free(out);
+    close(pipeFds[1]);
+
+    int status;
+    while(waitpid(child, &status, 0) == -1 && errno == EINTR);
+    if(!failed && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)){
+        errno = EIO;
+        failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+// Compresses the rows into a temporary file that replaces the file once it is complete, so a failing
+// compressor can't leave half a file behind. Returns the compressed size, -1 on error
+static long long editorSaveCompressed(){
+    struct stat st;
+    mode_t mode = stat(E.filename, &st) == 0 ? st.st_mode & 07777 : 0644;
+    size_t nameLen = strlen(E.filename);
+    char *tmp = malloc(nameLen + 16);
+    snprintf(tmp, nameLen + 16, "%s.saveXXXXXX", E.filename);
+    int fd = mkstemp(tmp);
+    if(fd == -1){
+        free(tmp);
+        return -1;
+    }
+    fchmod(fd, mode);
+
+    long long written = 0;
+    errno = 0;
+    int failed = E.compression == COMPRESS_GZIP ? saveGzip(fd, &written) : saveZstd(fd);
+    if(!failed && E.compression == COMPRESS_ZSTD) written = fstat(fd, &st) == 0 ? st.st_size : 0;
+    if(!failed) failed = fsync(fd) == -1 || rename(tmp, E.filename) == -1;
+    if(failed){
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+    free(tmp);
+
+    // Offsets into the compressed file mean nothing to the zero-copy save
+    if(E.saveSource != -1) close(E.saveSource);
+    E.saveSource = -1;
+    return written;
+}
+
+void editorSave(){
+    if(editorLoaderBusy()) return;
+    if(E.filename == NULL){
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if(E.filename == NULL){
+            editorSetStatusMessage("Save Aborted Sucessfully!");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+        E.compression = compressionFromName(E.filename);
+    }
+
+    if(E.compression){
+        long long written = editorSaveCompressed();
+        if(written == -1){
+            editorSetStatusMessage("Can't Save! I/O Error: %s", strerror(errno));
+            return;
+        }
+        editorSaveDone(E.offsets.totalBytes);
+        editorSetStatusMessage("%lld bytes written to disk (%lld compressed)", E.offsets.totalBytes, written);
+        return;
+    }
+
+    long long copied;
+    int zeroCopy = editorSaveZeroCopy(&copied);
+    if(zeroCopy == 1){
+        editorSaveDone(E.offsets.totalBytes);
+        editorSetStatusMessage("%lld bytes written to disk (%lld reused from the old file)", E.offsets.totalBytes, copied);
+        return;
+    }
+    if(zeroCopy == -1){
+        editorSetStatusMessage("Can't Save! I/O Error: %s", strerror(errno));
+        return;
+    }
+
+    size_t len;
+    char *buf = editorRowsToString(&len); // Get the file contents stored in buf, and have the length of it stored in len
+
+    int fd = (open(E.filename, O_RDWR | O_CREAT, 0644)); // Open the file with Read/Write permission, or create the file if its not there
+    if(fd != -1){ // Makes sure file was opend successfully
+        if(ftruncate(fd, len) != -1){ // Makes sure the memory allocation for teh file was successful
+            if(journalWriteAll(fd, buf, len) == 0){ // Makes sure the write to file was successful, over 2 GB takes more than one write
+                free(buf);
+                editorSaveSourceSet(fd);
+                close(fd);
+                editorSaveDone(len);
+                editorSetStatusMessage("%zu bytes written to disk", len);
+                return;
+            }
+        }
+        close(fd); // If file was opened but eveyrthing else fails, still close teh file;
+    }
+
+    free(buf); // Free the buffer holding the file anyway    
+    editorSetStatusMessage("Can't Save! I/O Error: %s", strerror(errno));
+}
+
+// Returns 0, or -1 in batch mode when the file couldn't be read in full, with why in the status message.
+// Interactively a file that can't be opened at all is fatal, as it always was
+int editorOpen(char *filename) {
+
+    free(E.filename);  // Avoid memory leaks
+    E.filename = malloc(strlen(filename) + 1);  // Allocate space for filename
+
+    strcpy(E.filename, filename);  // Copy filename manually
+
+    editorSelectSyntaxHighlight();
+
+    E.compression = COMPRESS_NONE;
+    int compressed = editorOpenCompressed(filename);
+    if (compressed == 1) { // Also when coming back from the hex view, that showed the raw file
+      E.forceText = 0;
+      return E.headless && E.loadError ? -1 : 0;
+    }
+    if (compressed == -1 && E.headless) return -1; // Editing the compressed bytes as text would wreck the file
+
+    // Binary files go to the hex view instead of being split into rows on stray newlines
+    if (!E.headless && !E.forceText && editorHexOpen(filename, 0)) return 0;
+    E.forceText = 0;
+
+    if (editorCacheLoad(filename)) {
+      E.dirty = 0;
+      editorJournalOpen(1);
+      return 0;
+    }
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+      if (!E.headless) die("fopen");
+      editorSetStatusMessage("Can't open: %s", strerror(errno)); // Only this file fails, not the whole batch
+      return -1;
+    }
+
+    char *line = NULL;
     size_t lineCap = 0;
     ssize_t lineLen;
 
-    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
-      while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) lineLen--;
-      
-      editorInsertRow(E.numRows, line, lineLen);
+    // Remember the raw line lengths of big files so quitting can write the line index cache
+    struct stat st;
+    int statOk = fstat(fileno(fp), &st) == 0;
+    int keepLens = statOk && st.st_size >= CACHE_MIN_SIZE;
+    if (statOk && st.st_size == 0) E.compression = compressionFromName(filename); // Nothing in it yet, so foo.gz is to be gzip
+    int lensCap = 0;
+
+    E.loadedPartial = 0;
+    long long off = 0;
+    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
+      ssize_t rawLen = lineLen;
+      if (keepLens) {
+        if (E.numLineLens == lensCap) {
+          lensCap = lensCap ? lensCap * 2 : 1024;
+          E.lineLens = realloc(E.lineLens, sizeof(uint32_t) * lensCap);
+        }
+        E.lineLens[E.numLineLens++] = lineLen;
+      }
+      E.loadedPartial = line[lineLen - 1] != '\n';
+      while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) lineLen--;
+      
+      editorInsertRow(E.numRows, line, lineLen);
+      editorRowSetOrigin(&E.row[E.numRows - 1], off, line, rawLen);
+      off += rawLen;
+    }
+    int readError = ferror(fp) ? errno : 0;
+    E.loadedBytes = ftell(fp);
+    editorSaveSourceSet(fileno(fp));
+    
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    if (readError && E.headless) {
+      editorSetStatusMessage("Read error after %lld bytes: %s", off, strerror(readError));
+      return -1;
+    }
+
+    editorJournalOpen(1);
+    return 0;
+  }
+
+/*** Journal ***/
+#define JOURNAL_RECORD_SIZE 13 // op, row, col, payload length
+
+static void journalEncode(char *dst, char op, int32_t a, int32_t b, uint32_t len){
+    dst[0] = op;
+    memcpy(&dst[1], &a, 4);
+    memcpy(&dst[5], &b, 4);
+    memcpy(&dst[9], &len, 4);
+}
+
+static int journalWriteAll(int fd, const char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One read() stops short of 2 GB on Linux, so journals bigger than that come in over several
+static int journalReadAll(int fd, char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = read(fd, buf, len);
+        if(n == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(n == 0){
+            errno = EIO; // Shorter than fstat said
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void journalStamp(const char *filename, struct journalHeader *h){
+    struct stat st;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, JOURNAL_MAGIC, 4);
+    h->recordSize = JOURNAL_RECORD_SIZE;
+    if(stat(filename, &st) == 0){
+        h->baseSize = st.st_size;
+        h->baseMtime = st.st_mtime;
+    }
+}
+
+static char *journalPathFor(const char *filename){
+    const char *slash = strrchr(filename, '/');
+    int dirLen = slash ? slash - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + 6);
+    memcpy(path, filename, dirLen);
+    sprintf(&path[dirLen], ".%s.tej", &filename[dirLen]);
+    return path;
+}
+
+// Snapshots can be over 4 GB, the high half of their length goes where other records keep the row
+static void journalEncodeSnapshot(char *dst, size_t len){
+    journalEncode(dst, JOURNAL_SNAPSHOT, (int32_t)((uint64_t)len >> 32), 0, (uint32_t)len);
+}
+
+// Temp file a compaction is written to before it is renamed over the journal. Forked snapshots get
+// numbered ones, so one never collides with another the writer is still busy with
+static char *journalTempPath(struct editorJournal *j, int snapshot){
+    char *tmp = malloc(strlen(j->path) + 16);
+    if(snapshot) sprintf(tmp, "%s.tmp%d", j->path, snapshot);
+    else sprintf(tmp, "%s.tmp", j->path);
+    return tmp;
+}
+
+// Writes a fresh journal (header, optional snapshot, then any records queued after it) to a temp file
+// and renames it over the old one, so a crash during compaction always leaves a usable journal behind
+static int journalRewrite(struct editorJournal *j, struct journalHeader *h, char *snapshot, size_t snapshotLen, char *records, size_t recordsLen){
+    char *tmp = journalTempPath(j, 0);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int ok = fd != -1 && journalWriteAll(fd, (char *)h, sizeof(*h)) == 0;
+    if(ok && snapshot){
+        char rec[JOURNAL_RECORD_SIZE];
+        journalEncodeSnapshot(rec, snapshotLen);
+        ok = journalWriteAll(fd, rec, sizeof(rec)) == 0 && journalWriteAll(fd, snapshot, snapshotLen) == 0;
+    }
+    if(ok) ok = journalWriteAll(fd, records, recordsLen) == 0;
+    if(ok) ok = fdatasync(fd) == 0 && rename(tmp, j->path) == 0;
+
+    if(ok){
+        if(j->fd != -1) close(j->fd);
+        j->fd = fd;
+    }else if(fd != -1){
+        close(fd);
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok ? 0 : -1;
+}
+
+// Runs in the child forked by a compaction: writes the header and the rows, as they were at the fork,
+// to the child's temp file. Only plain system calls, the parent's other threads (and whatever locks
+// they held) didn't come along
+static void journalSnapshotChild(char *tmp, struct journalHeader *h){
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd == -1) _exit(1);
+    size_t len = 0;
+    for(int j = 0; j < E.numRows; j++) len += E.row[j].size + 1;
+    char rec[JOURNAL_RECORD_SIZE];
+    journalEncodeSnapshot(rec, len);
+    int ok = journalWriteAll(fd, (char *)h, sizeof(*h)) == 0 && journalWriteAll(fd, rec, sizeof(rec)) == 0;
+
+    static char buf[SAVE_BUFFER_SIZE]; // The child's own copy, nothing else touches it
+    size_t used = 0;
+    for(int j = 0; j < E.numRows && ok; j++){
+        erow *row = &E.row[j];
+        if(used + row->size + 1 > sizeof(buf)){
+            ok = journalWriteAll(fd, buf, used) == 0;
+            used = 0;
+        }
+        if(row->size + 1 > (int)sizeof(buf)){ // Too long to buffer, straight out
+            ok = ok && journalWriteAll(fd, row->chars, row->size) == 0 && journalWriteAll(fd, "\n", 1) == 0;
+        }else{
+            memcpy(&buf[used], row->chars, row->size);
+            buf[used + row->size] = '\n';
+            used += row->size + 1;
+        }
+    }
+    ok = ok && journalWriteAll(fd, buf, used) == 0 && fdatasync(fd) == 0;
+    _exit(ok ? 0 : 1);
+}
+
+// Writer thread: waits for a forked snapshot, puts the records queued since the fork after it and
+// makes it the journal
+static void journalFinishSnapshot(struct editorJournal *j, pid_t child, char *tmp, char *records, size_t recordsLen){
+    int status;
+    while(waitpid(child, &status, 0) == -1 && errno == EINTR);
+    int fd = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? open(tmp, O_WRONLY | O_APPEND) : -1;
+    int ok = fd != -1 && journalWriteAll(fd, records, recordsLen) == 0 && fdatasync(fd) == 0 && rename(tmp, j->path) == 0;
+    if(ok){
+        if(j->fd != -1) close(j->fd);
+        j->fd = fd;
+    }else{
+        if(fd != -1) close(fd);
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+// Background thread that owns all of the journal's disk I/O. The main thread only ever appends to
+// j->pending under the lock, the writer swaps that buffer out and commits it with one write + fdatasync
+static void *journalWriterThread(void *arg){
+    struct editorJournal *j = arg;
+    char *batch = NULL;
+    size_t batchCap = 0;
+
+    pthread_mutex_lock(&j->lock);
+    while(1){
+        while(!j->stop && !j->pendingLen && !j->compact)
+            pthread_cond_wait(&j->cond, &j->lock);
+
+        if(!j->stop && !j->compact){
+            // Group commit: give the user a moment to type more before we pay for a sync
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += JOURNAL_FLUSH_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            while(!j->stop && !j->compact)
+                if(pthread_cond_timedwait(&j->cond, &j->lock, &deadline) == ETIMEDOUT) break;
+        }
+
+        // Take everything that is queued, the main thread starts filling an empty buffer again
+        char *records = j->pending;
+        size_t recordsLen = j->pendingLen;
+        size_t recordsCap = j->pendingCap;
+        j->pending = batch;
+        j->pendingCap = batchCap;
+        j->pendingLen = 0;
+        batch = records;
+        batchCap = recordsCap;
+
+        int compact = j->compact;
+        struct journalHeader h = j->header;
+        char *snapshot = j->snapshot;
+        size_t snapshotLen = j->snapshotLen;
+        pid_t child = j->snapshotChild;
+        char *snapshotPath = j->snapshotPath;
+        j->compact = 0;
+        j->snapshot = NULL;
+        j->snapshotChild = 0;
+        j->snapshotPath = NULL;
+        int stop = j->stop;
+        pthread_mutex_unlock(&j->lock);
+
+        if(compact && child){
+            journalFinishSnapshot(j, child, snapshotPath, records, recordsLen);
+        }else if(compact){
+            journalRewrite(j, &h, snapshot, snapshotLen, records, recordsLen);
+            free(snapshot);
+        }else if(recordsLen && j->fd != -1){
+            if(journalWriteAll(j->fd, records, recordsLen) == 0) fdatasync(j->fd);
+        }
+
+        pthread_mutex_lock(&j->lock);
+        if(stop && !j->pendingLen && !j->compact) break;
+    }
+    pthread_mutex_unlock(&j->lock);
+    free(batch);
+    return NULL;
+}
+
+void editorJournalRecord(char op, int a, int b, const char *s, size_t len){
+    struct editorJournal *j = E.journal;
+    if(!j || j->muted) return;
+    if(j->stale) editorJournalCompact(0); // The buffer is still the file as it is now, make that the base again
+
+    pthread_mutex_lock(&j->lock);
+    size_t need = j->pendingLen + JOURNAL_RECORD_SIZE + len;
+    if(need > j->pendingCap){
+        j->pendingCap = need * 2;
+        j->pending = realloc(j->pending, j->pendingCap);
+    }
+    journalEncode(&j->pending[j->pendingLen], op, a, b, len);
+    if(len) memcpy(&j->pending[j->pendingLen + JOURNAL_RECORD_SIZE], s, len);
+    int wasEmpty = j->pendingLen == 0;
+    j->pendingLen = need;
+    pthread_mutex_unlock(&j->lock);
+    if(wasEmpty) pthread_cond_signal(&j->cond);
+
+    j->sinceCompact += JOURNAL_RECORD_SIZE + len;
+    if(j->sinceCompact > j->compactAt) editorJournalCompact(1);
+}
+
+// Starts the journal over. With a snapshot the whole buffer is stored so every record before it can
+// be dropped, without one (right after a save) the file on disk is the new starting point. Copying a
+// big buffer here would stall typing, so a forked child writes the snapshot from its copy-on-write
+// view of the rows while the editor goes on; only if fork fails is it copied here
+void editorJournalCompact(int withSnapshot){
+    struct editorJournal *j = E.journal;
+    if(!j) return;
+
+    struct journalHeader h;
+    journalStamp(E.filename, &h);
+    char *snapshot = NULL;
+    size_t snapshotLen = withSnapshot ? (size_t)E.offsets.totalBytes : 0;
+    pid_t child = 0;
+    char *tmp = NULL;
+    if(withSnapshot){
+        tmp = journalTempPath(j, ++j->snapshots); // Not in the child, malloc's lock may be held by a thread that isn't there
+        child = fork();
+        if(child == 0) journalSnapshotChild(tmp, &h);
+        if(child == -1){
+            child = 0;
+            free(tmp);
+            tmp = NULL;
+            snapshot = editorRowsToString(&snapshotLen);
+        }
+    }
+
+    pthread_mutex_lock(&j->lock);
+    free(j->snapshot);
+    pid_t replaced = j->snapshotChild; // Forked for a compaction the writer hasn't got to, this one supersedes it
+    char *replacedPath = j->snapshotPath;
+    j->header = h;
+    j->snapshot = snapshot;
+    j->snapshotLen = snapshotLen;
+    j->snapshotChild = child;
+    j->snapshotPath = tmp;
+    j->pendingLen = 0; // Everything queued so far is already part of the snapshot or the saved file
+    j->compact = 1;
+    pthread_mutex_unlock(&j->lock);
+    pthread_cond_signal(&j->cond);
+    if(replaced){
+        kill(replaced, SIGKILL);
+        while(waitpid(replaced, NULL, 0) == -1 && errno == EINTR);
+        unlink(replacedPath);
+        free(replacedPath);
+    }
+
+    j->fromSnapshot = withSnapshot;
+    j->stale = 0;
+    j->sinceCompact = 0;
+    j->compactAt = snapshotLen > JOURNAL_COMPACT_MIN ? snapshotLen : JOURNAL_COMPACT_MIN;
+}
+
+static void journalReplayRecord(char op, int a, int b, const char *s, size_t len){
+    if(op == JOURNAL_SNAPSHOT){
+        while(E.numRows) editorDeleteRow(E.numRows - 1);
+        size_t start = 0;
+        for(size_t i = 0; i < len; i++){
+            if(s[i] == '\n'){
+                editorInsertRow(E.numRows, (char *)&s[start], i - start);
+                start = i + 1;
+            }
+        }
+        if(start < len) editorInsertRow(E.numRows, (char *)&s[start], len - start);
+        return;
+    }
+    if(op == JOURNAL_INSERT_ROW){
+        editorInsertRow(a, (char *)s, len);
+        return;
+    }
+    if(a < 0 || a >= E.numRows) return;
+    erow *row = &E.row[a];
+    switch(op){
+        case JOURNAL_INSERT_CHAR:
+            if(len == 1) editorRowInsertChar(row, b, s[0]);
+            break;
+        case JOURNAL_DELETE_CHAR:
+            if(b >= 0 && b < row->size) editorRowDeleteChar(row, b);
+            break;
+        case JOURNAL_APPEND_STRING:
+            editorRowAppendString(row, (char *)s, len);
+            break;
+        case JOURNAL_DELETE_ROW:
+            editorDeleteRow(a);
+            break;
+        case JOURNAL_TRUNCATE_ROW:
+            editorRowTruncate(row, b);
+            break;
+    }
+}
+
+// Looks for a journal left behind by a session that died, and offers to apply it on top of the file
+static void journalRecover(struct editorJournal *j){
+    int fd = open(j->path, O_RDONLY);
+    if(fd == -1) return;
+
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size <= (off_t)sizeof(struct journalHeader)){
+        close(fd);
+        return;
     }
-    
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
-  }
+    char *buf = malloc(st.st_size);
+    if(!buf || journalReadAll(fd, buf, st.st_size) == -1){
+        editorSetStatusMessage("Can't read swap file %s: %s", j->path, buf ? strerror(errno) : "out of memory");
+        free(buf);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    struct journalHeader h, current;
+    memcpy(&h, buf, sizeof(h));
+    journalStamp(E.filename, &current);
+    // A journal that starts with a snapshot holds the whole buffer, it doesn't need the file to be as it was
+    int fromSnapshot = st.st_size >= (off_t)(sizeof(h) + JOURNAL_RECORD_SIZE) && buf[sizeof(h)] == JOURNAL_SNAPSHOT;
+    if(memcmp(h.magic, JOURNAL_MAGIC, 4) != 0 || h.recordSize != JOURNAL_RECORD_SIZE ||
+       (!fromSnapshot && (h.baseSize != current.baseSize || h.baseMtime != current.baseMtime))){
+        // The file changed since the journal was written, replaying it would scramble the buffer
+        char *stale = malloc(strlen(j->path) + 2);
+        sprintf(stale, "%s~", j->path);
+        rename(j->path, stale);
+        editorSetStatusMessage("Swap file is out of date, moved it to %s", stale);
+        free(stale);
+        free(buf);
+        return;
+    }
+
+    editorSetStatusMessage("Found swap file %s. Recover unsaved changes? (y/n)", j->path);
+    editorRefreshScreen();
+    int c = editorReadKey();
+    if(c != 'y' && c != 'Y'){
+        editorSetStatusMessage("Swap file discarded");
+        free(buf);
+        return;
+    }
+
+    j->muted = 1;
+    size_t off = sizeof(h);
+    int applied = 0;
+    while(off + JOURNAL_RECORD_SIZE <= (size_t)st.st_size){
+        int32_t a, b;
+        uint32_t lenLow;
+        memcpy(&a, &buf[off + 1], 4);
+        memcpy(&b, &buf[off + 5], 4);
+        memcpy(&lenLow, &buf[off + 9], 4);
+        size_t len = lenLow;
+        if(buf[off] == JOURNAL_SNAPSHOT) len |= (size_t)(uint32_t)a << 32;
+        if(off + JOURNAL_RECORD_SIZE + len > (size_t)st.st_size) break; // Torn write at the moment we died
+        journalReplayRecord(buf[off], a, b, &buf[off + JOURNAL_RECORD_SIZE], len);
+        off += JOURNAL_RECORD_SIZE + len;
+        applied++;
+    }
+    j->muted = 0;
+    free(buf);
+    if(E.cy > E.numRows) E.cy = E.numRows;
+    E.cx = 0;
+    editorSetStatusMessage("Recovered %d edits from swap file", applied);
+}
+
+void editorJournalOpen(int recover){
+    if(E.journal || !E.filename || E.headless) return;
+
+    struct editorJournal *j = calloc(1, sizeof(*j));
+    j->path = journalPathFor(E.filename);
+    j->fd = -1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+
+    if(recover) journalRecover(j);
+
+    if(pthread_create(&j->writer, NULL, journalWriterThread, j) != 0){
+        free(j->path);
+        free(j);
+        return;
+    }
+    E.journal = j;
+    editorJournalCompact(E.dirty != 0); // Keep recovered edits, otherwise start from the file on disk
+}
+
+// Stops the writer once everything queued is on disk. The swap file is only deleted when the user
+// chose to leave, after a crash it is exactly what we want to find on the next start
+void editorJournalClose(int discard){
+    struct editorJournal *j = E.journal;
+    if(!j) return;
+    E.journal = NULL;
+
+    pthread_mutex_lock(&j->lock);
+    j->stop = 1;
+    pthread_mutex_unlock(&j->lock);
+    pthread_cond_signal(&j->cond);
+    pthread_join(j->writer, NULL);
+
+    if(j->fd != -1) close(j->fd);
+    if(discard) unlink(j->path);
+    free(j->pending);
+    free(j->snapshot);
+    free(j->path);
+    free(j);
+}
+
+/*** Follow mode ***/
+static void followWatch(struct editorFollow *f){
+    if(f->inotifyFd == -1) return;
+    if(f->watch != -1) inotify_rm_watch(f->inotifyFd, f->watch);
+    f->watch = inotify_add_watch(f->inotifyFd, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+// Turns the bytes in buf into rows. Text before the first newline finishes the last row if that
+// line was still being written the last time we looked
+static void followAppend(struct editorFollow *f, const char *buf, int len){
+    while(len > 0){
+        const char *nl = memchr(buf, '\n', len);
+        int lineLen = nl ? nl - buf : len;
+        int textLen = lineLen;
+        if(nl && textLen > 0 && buf[textLen - 1] == '\r') textLen--;
+
+        if(f->partial && E.numRows > 0) editorRowAppendString(&E.row[E.numRows - 1], (char *)buf, textLen);
+        else editorInsertRow(E.numRows, (char *)buf, textLen);
+
+        f->partial = nl == NULL;
+        if(!nl) break;
+        buf += lineLen + 1;
+        len -= lineLen + 1;
+    }
+}
+
+// The followed file was truncated or replaced, so the rows no longer say what is in it. Drops them all
+// along with everything indexed by row, the file is read again from its new start
+static void followReset(){
+    for(int j = 0; j < E.numRows; j++) editorFreeRow(&E.row[j]);
+    E.numRows = 0;
+    E.offsets.numRows = 0;
+    E.offsets.totalBytes = 0;
+    E.offsets.dirty = 0;
+    editorFoldClear();
+    if(E.brackets) E.brackets->dirty = 1;
+    E.cx = E.cy = E.rowOffset = E.colOffset = E.wrapOffset = 0;
+}
+
+// Checks the followed file for new data, returns 1 if any rows were added
+int editorFollowPoll(){
+    struct editorFollow *f = E.follow;
+    if(!f) return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long sinceLast = (now.tv_sec - f->lastPoll.tv_sec) * 1000 + (now.tv_nsec - f->lastPoll.tv_nsec) / 1000000;
+
+    int events = 0;
+    if(f->inotifyFd != -1){
+        char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        while((n = read(f->inotifyFd, ev, sizeof(ev))) > 0){
+            for(char *p = ev; p < ev + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+                struct inotify_event *e = (struct inotify_event *)p;
+                if(e->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) f->rotated = 1;
+            }
+            events = 1;
+        }
+        // Nothing happened to the file, don't even stat it. A rotated file is still polled
+        // since the watch is on the old inode and can't tell us when the new one shows up
+        if(!events && !(f->rotated && sinceLast >= FOLLOW_POLL_MS)) return 0;
+    }else if(sinceLast < FOLLOW_POLL_MS){
+        return 0;
+    }
+    f->lastPoll = now;
+
+    int savedDirty = E.dirty;
+    int pinned = E.cy >= E.numRows - 1; // Only stick to the end if the user hasn't scrolled away from it
+    int oldRows = E.numRows;
+    const char *notice = NULL;
+
+    // Rows read into a clean buffer are just the file's contents, journaling them would only make work
+    // for the writer thread. The header's stamp falls behind instead and is renewed on the next edit
+    struct editorJournal *j = E.journal;
+    if(j) j->muted = !savedDirty;
+
+    struct stat st;
+    char *buf = malloc(FOLLOW_READ_CHUNK);
+    ssize_t n;
+    while((n = pread(f->fd, buf, FOLLOW_READ_CHUNK, f->offset)) > 0){
+        followAppend(f, buf, n);
+        f->offset += n;
+    }
+
+    struct stat pathSt;
+    if(stat(E.filename, &pathSt) == 0 && fstat(f->fd, &st) == 0){
+        int rotated = pathSt.st_ino != st.st_ino || pathSt.st_dev != st.st_dev;
+        if((rotated || st.st_size < f->offset) && savedDirty){
+            // Starting over would throw the user's edits away, keep them and let the file go
+            free(buf);
+            editorFollowStop();
+            editorSetStatusMessage("File %s, stopped following to keep your unsaved changes", rotated ? "rotated" : "truncated");
+            return 1;
+        }
+        if(rotated){
+            // Switch over to whatever now lives at the path, the buffer becomes that file
+            int fd = open(E.filename, O_RDONLY);
+            if(fd != -1){
+                close(f->fd);
+                f->fd = fd;
+                f->rotated = 0;
+                followWatch(f);
+                notice = "File rotated, following the new one";
+            }
+        }else if(st.st_size < f->offset){
+            notice = "File truncated, following from its new start"; // In place, e.g. "> file"
+        }
+        if(notice){
+            followReset();
+            f->offset = 0;
+            f->partial = 0;
+            while((n = pread(f->fd, buf, FOLLOW_READ_CHUNK, f->offset)) > 0){
+                followAppend(f, buf, n);
+                f->offset += n;
+            }
+        }
+    }
+    free(buf);
+    if(j) j->muted = 0;
+
+    E.loadedBytes = f->offset;
+    E.loadedPartial = f->partial;
+    if(notice) editorSetStatusMessage("%s", notice);
+    if(E.numRows == oldRows && !notice) return 0;
+
+    // Appended rows are the file's contents, not edits the user needs to save. With edits on top, the
+    // file on disk keeps growing under the journal, so it is based on a snapshot of the buffer instead
+    E.dirty = savedDirty;
+    if(!E.dirty){
+        if(j) j->stale = 1;
+    }else if(j && !j->fromSnapshot){
+        editorJournalCompact(1);
+    }
+    if(pinned && E.numRows > 0){
+        E.cy = E.numRows - 1;
+        E.cx = 0;
+    }
+    return 1;
+}
+
+void editorFollowStop(){
+    struct editorFollow *f = E.follow;
+    if(!f) return;
+    E.follow = NULL;
+    if(f->inotifyFd != -1) close(f->inotifyFd);
+    close(f->fd);
+    free(f);
+}
+
+void editorFollowStart(){
+    if(E.follow) return;
+    if(!E.filename){
+        editorSetStatusMessage("Follow mode needs a file");
+        return;
+    }
+    if(E.compression){
+        editorSetStatusMessage("Can't follow a compressed file");
+        return;
+    }
+
+    int fd = open(E.filename, O_RDONLY);
+    if(fd == -1){
+        editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+        return;
+    }
+
+    free(E.lineLens); // Appended rows don't have lengths, the cache is skipped from here on
+    E.lineLens = NULL;
+    E.numLineLens = 0;
+
+    struct editorFollow *f = calloc(1, sizeof(*f));
+    f->fd = fd;
+    f->offset = E.loadedBytes;
+    f->partial = E.loadedPartial;
+    f->watch = -1;
+    f->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    followWatch(f);
+    if(f->watch == -1 && f->inotifyFd != -1){
+        close(f->inotifyFd);
+        f->inotifyFd = -1;
+    }
+    E.follow = f;
+
+    // Pick up anything written since the file was opened and jump to the end
+    f->lastPoll.tv_sec = 0;
+    if(f->inotifyFd != -1) f->rotated = 1; // Forces one full check on the first poll
+    E.cy = E.numRows > 0 ? E.numRows - 1 : 0;
+    E.cx = 0;
+    editorFollowPoll();
+    f->rotated = 0;
+    editorSetStatusMessage("Following %s (%s), Ctrl-T to stop", E.filename, f->inotifyFd != -1 ? "inotify" : "polling");
+}
+
+/*** Streaming open ***/
+// Rows are still coming in from stdin, a pipe or a compressed file, so the buffer isn't the whole text yet
+// and saving it would cut the file short
+int editorLoaderBusy(){
+    if(!E.loader) return 0;
+    editorSetStatusMessage("Still loading, the file can be saved once all of it is in");
+    return 1;
+}
+
+static void loaderPush(struct editorLoader *l, const char *buf, int len){
+    struct loaderBatch *b = malloc(sizeof(*b));
+    b->buf = malloc(len);
+    memcpy(b->buf, buf, len);
+    b->len = len;
+    b->next = NULL;
+
+    pthread_mutex_lock(&l->lock);
+    if(l->tail) l->tail->next = b;
+    else l->head = b;
+    l->tail = b;
+    pthread_mutex_unlock(&l->lock);
+}
+
+// Reads up to size bytes of text from the stream, inflating it first when it's gzip. Returns 0 at the end
+static ssize_t loaderRead(struct editorLoader *l, char *buf, size_t size){
+    if(!l->gz) return read(l->fd, buf, size);
+    z_stream *z = l->gz;
+    z->next_out = (Bytef *)buf;
+    z->avail_out = size;
+    while(z->avail_out == size){
+        if(z->avail_in == 0){
+            ssize_t n = read(l->fd, l->gzIn, LOADER_READ_CHUNK);
+            if(n == -1) return -1;
+            if(n == 0){
+                if(l->gzEnded) return 0;
+                errno = EBADMSG; // Cut off in the middle of a member
+                return -1;
+            }
+            z->next_in = l->gzIn;
+            z->avail_in = n;
+        }
+        int ret = inflate(z, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END){
+            l->gzEnded = 1;
+            inflateReset(z); // gzip files may be several members one after another, pigz and friends write them
+        }else if(ret == Z_OK){
+            l->gzEnded = 0;
+        }else if(ret != Z_BUF_ERROR){
+            errno = ret == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+            return -1;
+        }
+    }
+    return size - z->avail_out;
+}
+
+// Reads the stream on its own thread and queues it up in batches of whole lines. A short read
+// means the writer on the other end is slow, so whatever we have is handed over straight away
+static void *loaderReaderThread(void *arg){
+    struct editorLoader *l = arg;
+    int cap = LOADER_BATCH + LOADER_READ_CHUNK;
+    char *buf = malloc(cap);
+    int len = 0;
+    int error = 0;
+
+    while(1){
+        if(cap - len < LOADER_READ_CHUNK){
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t n = loaderRead(l, &buf[len], LOADER_READ_CHUNK);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0){
+            if(n == -1) error = errno;
+            break;
+        }
+        len += n;
+
+        pthread_mutex_lock(&l->lock);
+        l->bytesRead += n;
+        pthread_mutex_unlock(&l->lock);
+
+        if(len >= LOADER_BATCH || (n < LOADER_READ_CHUNK && !l->gz)){
+            char *lastNl = memrchr(buf, '\n', len);
+            if(!lastNl) continue;
+            int batchLen = lastNl - buf + 1;
+            loaderPush(l, buf, batchLen);
+            memmove(buf, &buf[batchLen], len - batchLen);
+            len -= batchLen;
+        }
+    }
+    if(len > 0) loaderPush(l, buf, len);
+    free(buf);
+
+    pthread_mutex_lock(&l->lock);
+    l->done = 1;
+    l->error = error;
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+// Moves queued batches into rows on the main thread, returns 1 if the screen needs redrawing
+int editorLoaderDrain(){
+    struct editorLoader *l = E.loader;
+    if(!l) return 0;
+
+    int savedDirty = E.dirty;
+    int drained = 0;
+    int redraw = 0;
+    while(drained < LOADER_DRAIN_MAX){
+        pthread_mutex_lock(&l->lock);
+        struct loaderBatch *b = l->head;
+        if(b){
+            l->head = b->next;
+            if(!l->head) l->tail = NULL;
+        }
+        pthread_mutex_unlock(&l->lock);
+        if(!b) break;
+
+        int start = 0;
+        for(int i = 0; i <= b->len; i++){
+            if(i == b->len && start == b->len) break;
+            if(i == b->len || b->buf[i] == '\n'){
+                int lineLen = i - start;
+                if(lineLen > 0 && i < b->len && b->buf[i - 1] == '\r') lineLen--;
+                editorInsertRow(E.numRows, &b->buf[start], lineLen);
+                start = i + 1;
+            }
+        }
+        drained += b->len;
+        l->bytesLoaded += b->len;
+        free(b->buf);
+        free(b);
+        redraw = 1;
+    }
+    E.dirty = savedDirty; // Streamed rows aren't edits
+
+    pthread_mutex_lock(&l->lock);
+    int finished = l->done && !l->head;
+    int error = l->error;
+    pthread_mutex_unlock(&l->lock);
+
+    if(finished){
+        if(l->threaded) pthread_join(l->reader, NULL);
+        if(l->fd != STDIN_FILENO) close(l->fd);
+        if(l->gz){
+            inflateEnd(l->gz);
+            free(l->gz);
+            free(l->gzIn);
+        }
+        if(l->child > 0){
+            int status;
+            while(waitpid(l->child, &status, 0) == -1 && errno == EINTR);
+            if(!error && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) error = EBADMSG;
+        }
+        E.loadError = error;
+        if(error) editorSetStatusMessage("Read error after %lld bytes: %s", l->bytesLoaded, strerror(error));
+        else editorSetStatusMessage("Loaded %lld bytes", l->bytesLoaded);
+        int journal = l->journal;
+        pthread_mutex_destroy(&l->lock);
+        free(l);
+        E.loader = NULL;
+        if(journal) editorJournalOpen(1); // Recovered edits apply to the whole file, so only now
+        redraw = 1;
+    }
+    return redraw;
+}
+
+static void editorLoaderStart(struct editorLoader *l){
+    pthread_mutex_init(&l->lock, NULL);
+    E.loader = l;
+    if(E.headless){ // Batch mode works on the whole file and is on a worker thread already, read it all here
+        loaderReaderThread(l);
+        while(E.loader) editorLoaderDrain();
+        return;
+    }
+    if(pthread_create(&l->reader, NULL, loaderReaderThread, l) != 0) die("pthread_create");
+    l->threaded = 1;
+}
+
+// Starts streaming rows in from fd. The editor is usable right away, rows show up as they arrive
+void editorOpenStream(int fd){
+    struct editorLoader *l = calloc(1, sizeof(*l));
+    l->fd = fd;
+    editorLoaderStart(l);
+}
+
+static int compressionFromMagic(const unsigned char *magic, int len){
+    if(len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return COMPRESS_GZIP;
+    if(len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+// Opens a gzip or zstd file by streaming it through the loader, decompressing on the reader thread (gzip)
+// or in a zstd process feeding it (zstd). Returns 1 once loading, 0 if the file isn't compressed and -1
+// if it is but can't be decompressed
+int editorOpenCompressed(const char *filename){
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return 0;
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    int compression = compressionFromMagic(magic, n > 0 ? n : 0);
+    if(compression == COMPRESS_NONE){
+        close(fd);
+        return 0;
+    }
+
+    struct editorLoader *l = calloc(1, sizeof(*l));
+    if(compression == COMPRESS_GZIP){
+        l->fd = fd;
+        l->gz = calloc(1, sizeof(z_stream));
+        l->gzIn = malloc(LOADER_READ_CHUNK);
+        if(inflateInit2(l->gz, 15 + 16) != Z_OK) die("inflateInit2"); // 15 + 16: gzip wrapper, largest window
+    }else{
+        int pipeFds[2];
+        char *argv[] = {"zstd", "-d", "-c", "-q", NULL};
+        int err = pipe2(pipeFds, O_CLOEXEC) == -1 ? errno : 0;
+        if(!err){
+            err = spawnZstd(argv, fd, pipeFds[1], &l->child);
+            close(pipeFds[1]);
+            if(err) close(pipeFds[0]);
+        }
+        close(fd);
+        if(err){
+            free(l);
+            editorSetStatusMessage("Can't decompress %s: zstd: %s", filename, strerror(err));
+            return -1;
+        }
+        l->fd = pipeFds[0];
+    }
+    E.compression = compression;
+    l->journal = !E.headless;
+    editorLoaderStart(l);
+    return 1;
+}
+
+// Status bar text for an in-progress load, empty once loading is done
+int editorLoaderProgress(char *buf, int size){
+    struct editorLoader *l = E.loader;
+    if(!l) return snprintf(buf, size, "%s", "");
+    pthread_mutex_lock(&l->lock);
+    long long bytesRead = l->bytesRead;
+    pthread_mutex_unlock(&l->lock);
+    return snprintf(buf, size, " [loading %.1f MB]", bytesRead / (1024.0 * 1024.0));
+}
 
 /** Find Function ***/
 void editorFindCallback(char *query, int key) {
-    static int lastMatch = -1;
-    static int direction = 1;
-
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+    struct editorSearch *s = &E.search;
+    if (s->savedHl) {
+        if (s->savedHlLine < E.numRows && E.row[s->savedHlLine].hl) {
+            erow *row = &E.row[s->savedHlLine];
+            memcpy(row->hl, s->savedHl, row->rsize < s->savedHlLen ? row->rsize : s->savedHlLen);
+        }
+        free(s->savedHl);
+        s->savedHl = NULL;
     }
 
     if (key == '\r' || key == '\x1b') {
-        lastMatch = -1;
-        direction = 1;
+        s->lastMatch = -1;
+        s->direction = 1;
         return;
     } 
     else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
+        s->direction = 1;
     } 
     else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+        s->direction = -1;
     } 
     else {
-        lastMatch = -1;
-        direction = 1;
+        s->lastMatch = -1;
+        s->direction = 1;
+    }
+
+    // If no previous match was found, start searching forward
+    if (s->lastMatch == -1) s->direction = 1;
+
+    int current = s->lastMatch;
+
+    for (int i = 0; i < E.numRows; i++) {
+        // Move to the next row in the search direction
+        current += s->direction;
+
+        if (current == -1) 
+            current = E.numRows - 1;  // If at the first row, wrap to last row
+        else if (current == E.numRows) 
+            current = 0;  // If at the last row, wrap to first row
+
+        erow *row = &E.row[current];
+        editorRowLoad(row);
+
+        char *match = strstr(row->render, query);
+        if (match) editorRowHighlight(row);
+        if (match) {
+            // If a match is found, update the last match index
+            s->lastMatch = current;
+
+            // Move the cursor to the match position
+            E.cy = current;
+            E.cx = editorRowRenderToCx(row, match - row->render);
+
+            // Adjust screen scrolling to ensure the match is visible
+            E.rowOffset = E.numRows;
+
+            s->savedHlLine = current;
+            s->savedHlLen = row->rsize;
+            s->savedHl = malloc(row->rsize);
+            memcpy(s->savedHl, row->hl, row->rsize);
+            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+            break;
+        }
+    }
+}
+
+void editorFind() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.colOffset;
+    int saved_rowoff = E.rowOffset;
+    int saved_wrapoff = E.wrapOffset;
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    if(query) {
+        free(query);
+    }else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.colOffset = saved_coloff;
+        E.rowOffset = saved_rowoff;
+        E.wrapOffset = saved_wrapoff;
+    }
+}
+
+
+/*** append buffer ***/
+struct abuf {
+    char *b;
+    int len;
+    int cap; // Grows geometrically so a frame costs a handful of reallocs, not one per append
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    if (len <= 0) return; // Prevent appending empty strings
+
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 4096;
+        while (cap < ab->len + len) cap *= 2;
+        char *newBuffer = realloc(ab->b, cap);
+        if (newBuffer == NULL) {
+            // Handle failure properly (maybe log an error)
+            return;
+        }
+        ab->b = newBuffer; // Update pointer only after successful realloc
+        ab->cap = cap;
+    }
+
+    memcpy(&ab->b[ab->len], s, len); // Copy new data
+    ab->len += len;                   // Update length
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+}
+
+/*** Frames ***/
+// What the core hands the render thread: a copy of everything on screen, so the core can go on
+// editing rows while the frame is still being turned into escape sequences and written out
+struct frameSpan{
+    int off; // Where the span starts in data
+    int len;
+    int text; // len bytes of row text followed by their len highlight classes, otherwise bytes sent as they are
+};
+
+struct frame{
+    struct abuf data;
+    struct frameSpan *spans;
+    int numSpans;
+    int spanCap;
+    int rawStart; // Start of the raw bytes appended since the last span was closed
+};
+
+void frameRender(const struct frame *f, struct abuf *ab);
+
+static void frameAddSpan(struct frame *f, int off, int len, int text){
+    if(f->numSpans == f->spanCap){
+        int cap = f->spanCap ? f->spanCap * 2 : 256;
+        struct frameSpan *spans = realloc(f->spans, cap * sizeof(struct frameSpan));
+        if(!spans) return;
+        f->spans = spans;
+        f->spanCap = cap;
+    }
+    f->spans[f->numSpans++] = (struct frameSpan){off, len, text};
+}
+
+// Everything appended to f->data since the last span goes out as it is
+static void frameCloseRaw(struct frame *f){
+    if(f->data.len > f->rawStart) frameAddSpan(f, f->rawStart, f->data.len - f->rawStart, 0);
+    f->rawStart = f->data.len;
+}
+
+// Copies len bytes of row text and their highlighting into the frame, returns the copy of the highlighting
+// so the caller can recolor it without touching the row
+static unsigned char *frameText(struct frame *f, const char *text, const unsigned char *hl, int len){
+    frameCloseRaw(f);
+    int off = f->data.len;
+    abAppend(&f->data, text, len);
+    abAppend(&f->data, (const char *)hl, len);
+    if(f->data.len != off + 2 * len){ // Out of memory, leave the row blank
+        f->data.len = f->rawStart = off;
+        return NULL;
+    }
+    frameAddSpan(f, off, len, 1);
+    f->rawStart = f->data.len;
+    return (unsigned char *)&f->data.b[off + len];
+}
+
+static void frameReset(struct frame *f){
+    f->data.len = 0;
+    f->numSpans = 0;
+    f->rawStart = 0;
+}
+
+static void frameFree(struct frame *f){
+    if(!f) return;
+    abFree(&f->data);
+    free(f->spans);
+    free(f);
+}
+
+/*** Render thread ***/
+// Frames go to the render thread through a one slot mailbox. A new frame replaces one the render thread
+// hasn't picked up yet, so while a big frame is still being written to a slow terminal the frames behind
+// it collapse into the latest one and the core never waits on the terminal
+struct editorRender{
+    struct frame *pending; // Latest frame not picked up yet, swapped in and out atomically
+    struct frame *spare; // A written frame handed back to be filled again, saves reallocating its buffers
+    int wakeFd; // eventfd bumped after every new frame
+    int stop;
+    pthread_t thread;
+};
+
+static void *renderThread(void *arg){
+    struct editorRender *r = arg;
+    struct abuf out = ABUF_INIT;
+    while(1){
+        struct frame *f = __atomic_exchange_n(&r->pending, NULL, __ATOMIC_ACQ_REL);
+        if(f){
+            out.len = 0;
+            frameRender(f, &out);
+            frameFree(__atomic_exchange_n(&r->spare, f, __ATOMIC_ACQ_REL)); // The frame is copied out, the core may refill it
+            journalWriteAll(STDOUT_FILENO, out.b, out.len);
+            continue;
+        }
+        if(__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) break; // Only once the last frame is out
+        uint64_t count;
+        if(read(r->wakeFd, &count, sizeof(count)) == -1 && errno != EINTR) break;
+    }
+    abFree(&out);
+    return NULL;
+}
+
+void editorRenderStart(){
+    struct editorRender *r = calloc(1, sizeof(struct editorRender));
+    if(!r) return;
+    r->wakeFd = eventfd(0, EFD_CLOEXEC);
+    if(r->wakeFd == -1){
+        free(r);
+        return;
+    }
+    if(pthread_create(&r->thread, NULL, renderThread, r) != 0){
+        close(r->wakeFd);
+        free(r);
+        return;
+    }
+    E.render = r;
+}
+
+// Writes out whatever frame is still pending and ends the render thread, the terminal is the core's again after this
+void editorRenderStop(){
+    if(!currentEditor || !E.render) return;
+    struct editorRender *r = E.render;
+    E.render = NULL;
+    __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    write(r->wakeFd, &one, sizeof(one));
+    pthread_join(r->thread, NULL);
+    close(r->wakeFd);
+    frameFree(r->pending);
+    frameFree(r->spare);
+    free(r);
+}
+
+// An empty frame for the core to draw into
+struct frame *editorRenderFrame(){
+    struct frame *f = E.render ? __atomic_exchange_n(&E.render->spare, NULL, __ATOMIC_ACQ_REL) : NULL;
+    if(!f) f = calloc(1, sizeof(struct frame));
+    if(!f) die("calloc");
+    frameReset(f);
+    return f;
+}
+
+void editorRenderSubmit(struct frame *f){
+    if(!E.render){ // No render thread, write it out here
+        struct abuf out = ABUF_INIT;
+        frameRender(f, &out);
+        write(STDOUT_FILENO, out.b, out.len);
+        abFree(&out);
+        frameFree(f);
+        return;
+    }
+    frameFree(__atomic_exchange_n(&E.render->pending, f, __ATOMIC_ACQ_REL)); // Never written, the new frame covers it
+    uint64_t one = 1;
+    write(E.render->wakeFd, &one, sizeof(one));
+}
+    
+/*** Hex view ***/
+// Maps the file and shows it as a hex dump if it has a NUL near the start, or whatever it has with
+// force. Returns 0 (and leaves the editor alone) for text, empty files and anything that can't be mapped
+int editorHexOpen(const char *filename, int force){
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) return 0;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0){
+        close(fd);
+        return 0;
+    }
+    unsigned char sniff[HEX_SNIFF_SIZE];
+    ssize_t n;
+    if(!force && ((n = pread(fd, sniff, sizeof(sniff), 0)) <= 0 || !memchr(sniff, '\0', n))){
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        close(fd);
+        return 0;
     }
+    madvise(map, st.st_size, MADV_RANDOM); // We jump around, read-ahead of the whole file would be wasted
 
-    // If no previous match was found, start searching forward
-    if (lastMatch == -1) direction = 1;
+    struct editorHex *h = calloc(1, sizeof(*h));
+    h->fd = fd;
+    h->map = map;
+    h->size = st.st_size;
+    E.hex = h;
+    E.dirty = 0;
+    return 1;
+}
 
-    int current = lastMatch;
+void editorHexClose(){
+    struct editorHex *h = E.hex;
+    if(!h) return;
+    munmap((void *)h->map, h->size);
+    close(h->fd);
+    free(h->lastSearch);
+    free(h);
+    E.hex = NULL;
+}
 
-    for (int i = 0; i < E.numRows; i++) {
-        // Move to the next row in the search direction
-        current += direction;
+// Ctrl-X: switches between the hex view and rows of text for the same file
+void editorHexToggle(){
+    if(!E.filename){
+        editorSetStatusMessage("No file to show as hex");
+        return;
+    }
+    if(E.dirty){
+        editorSetStatusMessage("Save your changes before switching to the hex view");
+        return;
+    }
 
-        if (current == -1) 
-            current = E.numRows - 1;  // If at the first row, wrap to last row
-        else if (current == E.numRows) 
-            current = 0;  // If at the last row, wrap to first row
+    char *filename = strdup(E.filename);
+    if(E.hex){
+        editorHexClose();
+        E.forceText = 1;
+        editorOpen(filename);
+    }else{
+        editorJournalClose(1);
+        editorFreeBuffer();
+        E.cx = E.cy = E.rowOffset = E.colOffset = 0;
+        E.filename = strdup(filename);
+        editorSelectSyntaxHighlight();
+        if(!editorHexOpen(filename, 1)){
+            E.forceText = 1;
+            editorOpen(filename);
+            editorSetStatusMessage("Can't show this file as hex");
+        }
+    }
+    free(filename);
+}
 
-        erow *row = &E.row[current];
+void editorHexScroll(){
+    struct editorHex *h = E.hex;
+    long long line = h->cursor / HEX_LINE_BYTES;
+    long long top = h->offset / HEX_LINE_BYTES;
+    if(line < top) top = line;
+    if(line >= top + E.screenRows) top = line - E.screenRows + 1;
+    h->offset = top * HEX_LINE_BYTES;
+}
 
-        char *match = strstr(row->render, query);
-        if (match) {
-            // If a match is found, update the last match index
-            lastMatch = current;
+int editorHexCursorRow(){
+    return (E.hex->cursor - E.hex->offset) / HEX_LINE_BYTES;
+}
 
-            // Move the cursor to the match position
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
+// Screen column of the cursor byte in the hex column: "oooooooooo  xx xx xx xx xx xx xx xx  xx ..."
+int editorHexCursorCol(){
+    int i = E.hex->cursor % HEX_LINE_BYTES;
+    int col = 12 + i * 3 + (i >= HEX_LINE_BYTES / 2);
+    return col < E.screenCols ? col : E.screenCols - 1;
+}
 
-            // Adjust screen scrolling to ensure the match is visible
-            E.rowOffset = E.numRows;
+// Only the lines on screen are formatted, whatever the size of the file
+void editorHexDrawRows(struct abuf *ab){
+    static const char digits[] = "0123456789abcdef";
+    struct editorHex *h = E.hex;
+    for(int y = 0; y < E.screenRows; y++){
+        long long off = h->offset + (long long)y * HEX_LINE_BYTES;
+        if(off >= h->size){
+            abAppend(ab, "~\x1b[K\r\n", 6);
+            continue;
+        }
+        int n = h->size - off < HEX_LINE_BYTES ? h->size - off : HEX_LINE_BYTES;
+        const unsigned char *bytes = &h->map[off];
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+        char line[16 + HEX_LINE_BYTES * 4 + 8];
+        int len = 0;
+        for(int shift = 36; shift >= 0; shift -= 4) line[len++] = digits[(off >> shift) & 0xf];
+        line[len++] = ' ';
+        line[len++] = ' ';
+        for(int i = 0; i < HEX_LINE_BYTES; i++){
+            if(i == HEX_LINE_BYTES / 2) line[len++] = ' ';
+            line[len++] = i < n ? digits[bytes[i] >> 4] : ' ';
+            line[len++] = i < n ? digits[bytes[i] & 0xf] : ' ';
+            line[len++] = ' ';
         }
-    }
-}
+        line[len++] = ' ';
+        line[len++] = '|';
+        for(int i = 0; i < n; i++) line[len++] = (bytes[i] >= 32 && bytes[i] < 127) ? bytes[i] : '.';
+        line[len++] = '|';
 
-void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.colOffset;
-    int saved_rowoff = E.rowOffset;
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-    if(query) {
-        free(query);
-    }else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.colOffset = saved_coloff;
-        E.rowOffset = saved_rowoff;
+        int cursorAt = -1; // Where the cursor byte's char is in the ASCII column, drawn inverted
+        if(h->cursor >= off && h->cursor < off + n) cursorAt = len - 1 - n + (h->cursor - off);
+        if(len > E.screenCols) len = E.screenCols;
+        if(cursorAt >= 0 && cursorAt < len){
+            abAppend(ab, line, cursorAt);
+            abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, &line[cursorAt], 1);
+            abAppend(ab, "\x1b[m", 3);
+            abAppend(ab, &line[cursorAt + 1], len - cursorAt - 1);
+        }else{
+            abAppend(ab, line, len);
+        }
+        abAppend(ab, "\x1b[K\r\n", 5);
     }
 }
 
+static void editorHexMoveTo(long long to){
+    struct editorHex *h = E.hex;
+    if(to >= h->size) to = h->size - 1;
+    if(to < 0) to = 0;
+    h->cursor = to;
+}
 
-/*** append buffer ***/
-struct abuf {
-    char *b;
-    int len;
-};
-
-#define ABUF_INIT {NULL, 0}
+// Offset in decimal, or hex with a 0x prefix. A leading + or - moves relative to the cursor
+static void editorHexGoto(){
+    char *query = editorPrompt("Go to offset: %s (0x for hex, +/- relative, ESC to cancel)", NULL);
+    if(!query) return;
+    char *p = query;
+    int sign = 0;
+    if(*p == '+' || *p == '-') sign = *p++ == '+' ? 1 : -1;
+    int hex = p[0] == '0' && (p[1] == 'x' || p[1] == 'X'); // Base 0 would read a leading 0 as octal
+    char *end;
+    errno = 0;
+    long long value = strtoll(p, &end, hex ? 16 : 10);
+    if(errno || end == p || *end){
+        editorSetStatusMessage("Not an offset: %s", query);
+    }else{
+        editorHexMoveTo(sign ? E.hex->cursor + sign * value : value);
+    }
+    free(query);
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    if (len <= 0) return; // Prevent appending empty strings
+// First offset in [from, to) where needle starts, or -1. Goes through the mapping a window at a time
+// and unmaps each window once searched, so a search through a huge file doesn't keep all of it resident
+static long long hexFind(long long from, long long to, const char *needle, int len){
+    struct editorHex *h = E.hex;
+    if(to > h->size) to = h->size;
+    while(from + len <= to){
+        long long end = from + HEX_SEARCH_WINDOW < to ? from + HEX_SEARCH_WINDOW : to;
+        // Look len - 1 bytes into the next window for a match that starts in this one
+        long long scanEnd = end + len - 1 < to ? end + len - 1 : to;
+        const unsigned char *hit = memmem(&h->map[from], scanEnd - from, needle, len);
+        long long page = sysconf(_SC_PAGESIZE);
+        long long start = from / page * page;
+        madvise((void *)&h->map[start], end - start, MADV_DONTNEED);
+        if(hit) return hit - h->map;
+        from = end;
+    }
+    return -1;
+}
 
-    char *newBuffer = realloc(ab->b, ab->len + len);
-    if (newBuffer == NULL) {
-        // Handle failure properly (maybe log an error)
+// Searches for text, or for raw bytes written as hex after a 0x prefix ("0x7f 45 4c 46"). Empty
+// input repeats the last search. Wraps around to the start of the file
+static void editorHexSearch(){
+    struct editorHex *h = E.hex;
+    char *query = editorPrompt("Search: %s (0x for hex bytes, Enter on empty repeats, ESC to cancel)", NULL);
+    if(query){
+        int len = strlen(query);
+        if(len > 2 && query[0] == '0' && (query[1] == 'x' || query[1] == 'X')){
+            int n = 0;
+            int ok = 1;
+            for(char *p = query + 2; *p && ok;){
+                if(*p == ' '){
+                    p++;
+                    continue;
+                }
+                char pair[3] = {p[0], p[0] ? p[1] : 0, 0};
+                char *end;
+                long byte = strtol(pair, &end, 16);
+                ok = end == pair + 2;
+                if(!ok) break;
+                query[n++] = byte;
+                p += 2;
+            }
+            if(!ok || n == 0){
+                editorSetStatusMessage("Hex bytes come in pairs of digits");
+                free(query);
+                return;
+            }
+            len = n;
+        }
+        free(h->lastSearch);
+        h->lastSearch = query;
+        h->lastSearchLen = len;
+    }else if(!h->lastSearch){
         return;
     }
 
-    memcpy(&newBuffer[ab->len], s, len); // Copy new data
-    ab->b = newBuffer;                   // Update pointer only after successful realloc
-    ab->len += len;                       // Update length
+    long long from = h->cursor + 1;
+    long long found = hexFind(from, h->size, h->lastSearch, h->lastSearchLen);
+    if(found == -1) found = hexFind(0, from + h->lastSearchLen - 1, h->lastSearch, h->lastSearchLen);
+    if(found == -1){
+        editorSetStatusMessage("Not found");
+        return;
+    }
+    if(found < from) editorSetStatusMessage("Search wrapped around to the start");
+    h->cursor = found;
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
+void editorHexProcessKey(int c){
+    struct editorHex *h = E.hex;
+    switch(c){
+        case ARROW_LEFT: editorHexMoveTo(h->cursor - 1); break;
+        case ARROW_RIGHT: editorHexMoveTo(h->cursor + 1); break;
+        case ARROW_UP: if(h->cursor >= HEX_LINE_BYTES) h->cursor -= HEX_LINE_BYTES; break;
+        case ARROW_DOWN: if(h->cursor + HEX_LINE_BYTES < h->size) h->cursor += HEX_LINE_BYTES; break;
+        case PAGE_UP: editorHexMoveTo(h->cursor - (long long)E.screenRows * HEX_LINE_BYTES); break;
+        case PAGE_DOWN: editorHexMoveTo(h->cursor + (long long)E.screenRows * HEX_LINE_BYTES); break;
+        case HOME_KEY: h->cursor -= h->cursor % HEX_LINE_BYTES; break;
+        case END_KEY: editorHexMoveTo(h->cursor - h->cursor % HEX_LINE_BYTES + HEX_LINE_BYTES - 1); break;
+        case CTRL_KEY('g'): editorHexGoto(); break;
+        case CTRL_KEY('f'): editorHexSearch(); break;
+        case CTRL_KEY('x'): editorHexToggle(); break;
+        case CTRL_KEY('l'):
+        case '\x1b':
+            break;
+        default:
+            editorSetStatusMessage("The hex view is read-only, Ctrl-X switches to text");
+            break;
+    }
 }
-    
+
 /*** output ***/
 void editorScroll() {  
     E.rx = 0;
     if(E.cy < E.numRows){
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
     }
+    // Jumps (find, goto, brackets) can land in a fold, open it. The top row can get folded away under us too
+    int fold = editorFoldAt(E.cy);
+    if (fold != -1) editorFoldRemove(fold);
+    fold = editorFoldAt(E.rowOffset);
+    if (fold != -1) {
+        int start, end;
+        editorFoldRange(fold, &start, &end);
+        E.rowOffset = start - 1;
+    }
+
+    if (E.softWrap) {
+        editorWrapScroll();
+        return;
+    }
+
     // If the cursor's Y position (cy) is above the visible screen, adjust rowOffset to bring it into view  
     if (E.cy < E.rowOffset) {  
         E.rowOffset = E.cy;  
     }  
-    // If the cursor's Y position is below the visible screen, scroll down to keep it visible  
-    if (E.cy >= E.rowOffset + E.screenRows) {  
-        E.rowOffset = E.cy - E.screenRows + 1;  
+    // If the cursor's Y position is below the visible screen, scroll down to keep it visible. Folded rows don't take up lines
+    int cyLine = editorVisibleLine(E.cy);
+    if (cyLine >= editorVisibleLine(E.rowOffset) + E.screenRows) {  
+        E.rowOffset = editorVisibleToRow(cyLine - E.screenRows + 1);  
     }  
 
     // If the cursor's X position (cx) is left of the visible screen, adjust coloff to bring it into view  
@@ -783,9 +5178,106 @@ void editorScroll() {
 
 
 
-void editorDrawRows(struct abuf *ab){
-    for(int y = 0; y < E.screenRows; y++) {
-        int fileRow = y + E.rowOffset;
+// Escape sequence for each highlight class, so drawing never formats one. HL_NORMAL is the default
+// foreground, classes that share a color point at the same entry so switching between them is free
+struct sgrSeq{
+    char seq[8];
+    int len;
+};
+static struct sgrSeq sgrSeqs[256];
+static const struct sgrSeq *sgrTable[256];
+
+static void editorBuildSgrTable(){
+    for(int hl = 0; hl < 256; hl++){
+        int color = hl == HL_NORMAL ? 39 : syntaxToColor(hl);
+        sgrTable[hl] = &sgrSeqs[hl];
+        for(int prev = 0; prev < hl; prev++)
+            if((prev == HL_NORMAL ? 39 : syntaxToColor(prev)) == color){
+                sgrTable[hl] = sgrTable[prev];
+                break;
+            }
+        if(sgrTable[hl] == &sgrSeqs[hl])
+            sgrSeqs[hl].len = snprintf(sgrSeqs[hl].seq, sizeof(sgrSeqs[hl].seq), "\x1b[%dm", color);
+    }
+}
+
+// Length of the run at the start of c that is printable ASCII in the same highlight class
+static int drawRunLen(const char *c, const unsigned char *hl, int len){
+    unsigned char cls = hl[0];
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i clsv = _mm_set1_epi8((char)cls);
+    const __m128i lo = _mm_set1_epi8(0x1f);
+    const __m128i hi = _mm_set1_epi8(0x7f);
+    for(; i + 16 <= len; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)&c[i]);
+        __m128i h = _mm_loadu_si128((const __m128i *)&hl[i]);
+        // Bytes from 0x80 up are negative as signed chars, so they fail the first compare
+        __m128i ok = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)), _mm_cmpeq_epi8(h, clsv));
+        int mask = _mm_movemask_epi8(ok);
+        if(mask != 0xffff) return i + __builtin_ctz(~mask);
+    }
+#endif
+    while(i < len && hl[i] == cls && c[i] >= 0x20 && c[i] < 0x7f) i++;
+    return i;
+}
+
+// Turns one row's worth of text from a frame into escape sequences, run by the render thread
+static void drawText(struct abuf *ab, const char *c, const unsigned char *hl, int len){
+    const struct sgrSeq *currentColor = sgrTable[HL_NORMAL];
+    for(int j = 0; j < len;){
+        // Printable ASCII in one color goes out as a single copy
+        int run = drawRunLen(&c[j], &hl[j], len - j);
+        if(run > 0){
+            const struct sgrSeq *color = sgrTable[hl[j]];
+            if(color != currentColor){
+                abAppend(ab, color->seq, color->len);
+                currentColor = color;
+            }
+            abAppend(ab, &c[j], run);
+            j += run;
+            continue;
+        }
+
+        // Control chars and UTF-8 one at a time
+        int width = 1;
+        int n = (unsigned char)c[j] < 0x80 ? 1 : utf8Decode(&c[j], len - j, &width);
+        if((unsigned char)c[j] < 32 || c[j] == 127){
+            char sym[] = {'\x1b', '[', '7', 'm', (c[j] <= 26) ? '@' + c[j] : '?', '\x1b', '[', 'm'};
+            abAppend(ab, sym, sizeof(sym));
+            if(currentColor != sgrTable[HL_NORMAL]) abAppend(ab, currentColor->seq, currentColor->len);
+        }else{
+            const struct sgrSeq *color = sgrTable[hl[j]];
+            if(color != currentColor){
+                abAppend(ab, color->seq, color->len);
+                currentColor = color;
+            }
+            abAppend(ab, &c[j], n);
+        }
+        j += n;
+    }
+}
+
+// Writes the escape sequences for a whole frame into ab
+void frameRender(const struct frame *f, struct abuf *ab){
+    for(int i = 0; i < f->numSpans; i++){
+        const struct frameSpan *span = &f->spans[i];
+        if(span->text) drawText(ab, &f->data.b[span->off], (const unsigned char *)&f->data.b[span->off + span->len], span->len);
+        else abAppend(ab, &f->data.b[span->off], span->len);
+    }
+}
+
+void editorDrawRows(struct frame *f){
+    if(!sgrTable[HL_NORMAL]) editorBuildSgrTable();
+    struct abuf *ab = &f->data;
+
+    // The bracket under the cursor and its match are drawn in their own color
+    int brAt = -1, brMatchY = -1, brMatchAt = -1;
+    if(!editorCursorBracketMatch(&brAt, &brMatchY, &brMatchAt)) brAt = -1;
+
+    int fileRow = E.rowOffset;
+    int wrapLine = E.softWrap ? E.wrapOffset : 0; // Screen line of fileRow being drawn
+    for(int y = 0; y < E.screenRows; y++, editorWrapNextLine(&fileRow, &wrapLine)) {
         if(fileRow >= E.numRows){      
             if(E.numRows == 0 &&  y == E.screenRows/3){
                 char welcome[80];
@@ -803,41 +5295,53 @@ void editorDrawRows(struct abuf *ab){
                 abAppend(ab, "~", 1);
             }
         }else{
-            int len = E.row[fileRow].rsize - E.colOffset;
-            if(len < 0) len = 0;
-            if(len > E.screenCols) len = E.screenCols;
-            char *c = &E.row[fileRow].render[E.colOffset];
-            unsigned char *hl = &E.row[fileRow].hl[E.colOffset];
-            int currentColor = -1;
-            for(int j = 0; j < len; j++){
-                if(iscntrl(c[j])){
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+            erow *row = &E.row[fileRow];
+            editorRowHighlight(row);
+            int startRx, start, avail, end = row->rsize;
+            if(E.softWrap){ // Just this screen line of the row
+                int endRx;
+                wrapLineStart(row, wrapLine, &start, &startRx);
+                if(wrapLine + 1 < row->wrapCount) wrapLineStart(row, wrapLine + 1, &end, &endRx);
+                avail = E.screenCols;
+            }else{
+                start = editorRowRxToRender(row, E.colOffset, &startRx);
+                avail = E.screenCols - (startRx - E.colOffset);
+                for(int pad = startRx - E.colOffset; pad > 0; pad--) abAppend(ab, " ", 1); // Half of a wide char cut off on the left
+            }
+
+            // Only the part of the row that fits on screen goes into the frame
+            int len = end - start;
+            if(row->ascii){
+                if(len > avail) len = avail;
+                avail -= len;
+            }else{
+                int fit = 0;
+                while(fit < len){
+                    int width = 1;
+                    int n = (unsigned char)row->render[start + fit] < 0x80 ? 1 : utf8Decode(&row->render[start + fit], len - fit, &width);
+                    if(width > avail) break;
+                    avail -= width;
+                    fit += n;
+                }
+                len = fit;
+            }
+            unsigned char *hl = frameText(f, &row->render[start], &row->hl[start], len);
+            if(hl && brAt != -1 && fileRow == E.cy && brAt >= start && brAt < start + len) hl[brAt - start] = HL_BRACKET;
+            if(hl && brAt != -1 && fileRow == brMatchY && brMatchAt >= start && brMatchAt < start + len) hl[brMatchAt - start] = HL_BRACKET;
+            abAppend(ab, "\x1b[39m", 5);
+            int fold = E.softWrap && wrapLine + 1 < row->wrapCount ? -1 : editorFoldAt(fileRow + 1);
+            if(fold != -1){ // Show how much is folded away after the row, if it fits
+                char marker[32];
+                int foldStart, foldEnd;
+                editorFoldRange(fold, &foldStart, &foldEnd);
+                int folded = foldEnd - foldStart + 1;
+                int markerLen = snprintf(marker, sizeof(marker), " +%d line%s", folded, folded == 1 ? "" : "s");
+                if(markerLen <= avail){
                     abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);	
-                    if(currentColor != -1){
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
-                        abAppend(ab, buf, clen);
-                    }
-                }else if(hl[j] == HL_NORMAL) {
-                    if(currentColor != -1){
-                        abAppend(ab, "\x1b[39m", 5);
-                        currentColor = -1;
-                    }                    
-                    abAppend(ab, &c[j], 1);
-                }else {
-                    int color = syntaxToColor(hl[j]);
-                    if(color != currentColor){
-                        currentColor = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    abAppend(ab, marker, markerLen);
+                    abAppend(ab, "\x1b[m", 3);
                 }
             }
-            abAppend(ab, "\x1b[39m]", 5);
         }
         abAppend(ab, "\x1b[K", 3);
         // Add a new line as ling as we are not at the bottom of the screen
@@ -847,9 +5351,16 @@ void editorDrawRows(struct abuf *ab){
 
 void editorDrawStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[7m", 4); // Change color to inverted
-    char status[80], rstatus[80]; // File Info for status bar
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numRows, E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->fileType : "No File Type", E.cy+1, E.numRows);
+    char status[80], rstatus[80], progress[32]; // File Info for status bar
+    editorLoaderProgress(progress, sizeof(progress));
+    int len, rlen;
+    if(E.hex){
+      len = snprintf(status, sizeof(status), "%.20s - %lld bytes [hex]", E.filename, E.hex->size);
+      rlen = snprintf(rstatus, sizeof(rstatus), "0x%llx/0x%llx", E.hex->cursor, E.hex->size);
+    }else{
+      len = snprintf(status, sizeof(status), "%.20s - %d lines, %lld bytes %s%s%s%s", E.filename ? E.filename : "[No Name]", E.numRows, E.offsets.totalBytes, E.dirty ? "(modified)" : "", E.follow ? " [follow]" : "", E.softWrap ? " [wrap]" : "", progress);
+      rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->fileType : "No File Type", E.cy+1, E.numRows);
+    }
     if(len > E.screenCols) len = E.screenCols;
     abAppend(ab, status, len); // Print out the Filename and num of lines on the left side of bar
     while (len < E.screenCols) { // Print rest inverted color status bar
@@ -873,28 +5384,36 @@ void editorDrawMessageBar(struct abuf *ab){
 }
 
 void editorRefreshScreen() {
-    editorScroll();
+    if(E.hex) editorHexScroll();
+    else editorScroll();
     
-    struct abuf ab = ABUF_INIT;
+    struct frame *f = editorRenderFrame();
+    struct abuf *ab = &f->data;
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3); // Reposition the cursor to the top right
+    abAppend(ab, "\x1b[?25l", 6);
+    abAppend(ab, "\x1b[H", 3); // Reposition the cursor to the top right
   
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    if(E.hex) editorHexDrawRows(ab);
+    else editorDrawRows(f);
+    editorDrawStatusBar(ab);
+    editorDrawMessageBar(ab);
 
     // Place the cursor on teh screen based off its current position
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOffset) + 1, (E.rx - E.colOffset) + 1);
-    abAppend(&ab, buf, strlen(buf));    
+    int wrapY, wrapX;
+    if(E.hex) snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editorHexCursorRow() + 1, editorHexCursorCol() + 1);
+    else if(E.softWrap){
+        editorWrapCursorScreen(&wrapY, &wrapX);
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", wrapY + 1, wrapX + 1);
+    }else snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (editorVisibleLine(E.cy) - editorVisibleLine(E.rowOffset)) + 1, (E.rx - E.colOffset) + 1);
+    abAppend(ab, buf, strlen(buf));    
     
-    abAppend(&ab, "\x1b[?25l", 6);
+    abAppend(ab, "\x1b[?25l", 6);
 
-    abAppend(&ab, "\x1b[?25h", 6); // Put the cursor back
+    abAppend(ab, "\x1b[?25h", 6); // Put the cursor back
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    frameCloseRaw(f);
+    editorRenderSubmit(f);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -906,6 +5425,12 @@ void editorSetStatusMessage(const char *fmt, ...) {
   }
 
 /*** input ***/
+// Called whenever editorReadKey times out waiting for a key, returns 1 if the screen needs redrawing
+int editorIdle(){
+    int redraw = editorLoaderDrain();
+    return editorFollowPoll() || redraw;
+}
+
 char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
@@ -931,7 +5456,7 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
           if(callback) callback(buf, c);
           return buf;
         }
-      } else if (!iscntrl(c) && c < 128) {
+      } else if ((c >= 32 && c < 127) || (c >= 128 && c < 256)) { // Printable ASCII or a byte of a UTF-8 char
         if (buflen == bufsize - 1) {
           bufsize *= 2;
           buf = realloc(buf, bufsize);
@@ -950,50 +5475,63 @@ void editorMoveCursor(int key) {
     switch (key) {
       case ARROW_LEFT:
         if(E.cx != 0){
-            E.cx--;
+            E.cx = editorRowPrevChar(row, E.cx);
         }else if(E.cy != 0){
-            E.cy--;
+            E.cy = editorPrevVisible(E.cy);
             E.cx = E.row[E.cy].size;
         }
         break;
       case ARROW_RIGHT:
         if(row && E.cx < row->size){
-            E.cx++;
+            E.cx = editorRowNextChar(row, E.cx);
         }else if(row && E.cx == row->size){
-            E.cy++;
+            E.cy = editorNextVisible(E.cy);
             E.cx = 0;
         }
         break;
       case ARROW_UP:
-        if(E.cy != 0) E.cy--;
+        if(E.softWrap) editorWrapMove(-1);
+        else if(E.cy != 0) E.cy = editorPrevVisible(E.cy); // Folded rows are stepped over
         break;
       case ARROW_DOWN:
-        if(E.cy != E.numRows) E.cy++;
+        if(E.softWrap) editorWrapMove(1);
+        else if(E.cy != E.numRows) E.cy = editorNextVisible(E.cy);
         break;
     }
+    editorSnapCursor();
+}
 
-
-    
-    row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+// Keeps cx on the cursor's row after cy moved
+void editorSnapCursor(){
+    erow *row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
     // Get the length of current row, and if the cursor is past it, snap it to the end of current line
     int rowLen = row ? row->size : 0;
     if (E.cx > rowLen) {
         E.cx = rowLen;
     }
+    // Moving up or down can land in the middle of a multi-byte char, back up to where it starts
+    if (row && E.cx > 0 && E.cx < rowLen)
+        E.cx = editorRowPrevChar(row, editorRowNextChar(row, E.cx));
 }
 void editorProcessKeypress() {
-    static int quit_times = QUIT_TIMES;
     int c = editorReadKey();
+    if (E.hex && c != CTRL_KEY('q')) {
+        editorHexProcessKey(c);
+        return;
+    }
     switch (c) {
         case '\r': // Enter Key
             editorInsertNewline();
             break;
         case CTRL_KEY('q'):
-            if(E.dirty && quit_times > 0){
-                editorSetStatusMessage("WARNING! File has unsaved changes. Press Ctrl-Q %d more times to quit", quit_times);
-                quit_times--;
+            if(E.dirty && E.quitTimes > 0){
+                editorSetStatusMessage("WARNING! File has unsaved changes. Press Ctrl-Q %d more times to quit", E.quitTimes);
+                E.quitTimes--;
                 return;
             }
+            editorJournalClose(1); // Leaving on purpose, nothing left to recover
+            editorCacheSave(); // Remember where we were for next time
+            editorRenderStop();
             write(STDOUT_FILENO, "\x1b[2J", 4); // Clear the screen
             write(STDOUT_FILENO, "\x1b[H", 3); // Reposition the cursor to the top right
             exit(0);
@@ -1010,6 +5548,32 @@ void editorProcessKeypress() {
         case CTRL_KEY('f'):
             editorFind();
             break;
+        case CTRL_KEY('b'):
+            editorJumpToBracket();
+            break;
+        case CTRL_KEY('x'):
+            editorHexToggle();
+            break;
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+        case CTRL_KEY('e'):
+            editorLineCommand();
+            break;
+        case CTRL_KEY('n'):
+        case CTRL_KEY('p'):
+            editorComplete(c == CTRL_KEY('n') ? 1 : -1, E.completing);
+            E.completing = 1;
+            E.quitTimes = QUIT_TIMES;
+            return; // Another Ctrl-N / Ctrl-P right after cycles through the same candidates
+        case CTRL_KEY('t'):
+            if(E.follow){
+                editorFollowStop();
+                editorSetStatusMessage("Stopped following");
+            }else{
+                editorFollowStart();
+            }
+            break;
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DELETE_KEY:
@@ -1018,18 +5582,32 @@ void editorProcessKeypress() {
             break;
         case PAGE_UP:
         case PAGE_DOWN:
-        {
+        if (E.softWrap) {
+            for (int times = E.screenRows; times > 0; times--) editorWrapMove(c == PAGE_UP ? -1 : 1);
+        } else {
+            // Counted in visible lines, so a page skips folds without stepping through them
+            int line = editorVisibleLine(E.rowOffset);
             if (c == PAGE_UP) {
-              E.cy = E.rowOffset;
+              line -= E.screenRows;
             } else if (c == PAGE_DOWN) {
-              E.cy = E.rowOffset + E.screenRows - 1;
-              if (E.cy > E.numRows) E.cy = E.numRows;
+              line += 2 * E.screenRows - 1;
             }
-            int times = E.screenRows;
-            while (times--)
-              editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+            int lastLine = editorVisibleLine(E.numRows);
+            if (line > lastLine) line = lastLine;
+            if (line < 0) line = 0;
+            E.cy = editorVisibleToRow(line);
+            editorSnapCursor();
         }
             break;
+        case CTRL_KEY('k'):
+            editorFoldToggle();
+            break;
+        case CTRL_KEY('y'):
+            editorFoldAll();
+            break;
+        case CTRL_KEY('w'):
+            editorSoftWrapToggle();
+            break;
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -1045,17 +5623,20 @@ void editorProcessKeypress() {
             break;
     }
 
-    quit_times = QUIT_TIMES;
+    E.quitTimes = QUIT_TIMES;
+    E.completing = 0;
 }
 
 /*** init ***/
 
-void initEditor() {
+// Resets the current buffer to empty, without touching the terminal
+void initEditorState() {
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.numRows = 0;
     E.row = NULL;
+    E.rowCap = 0;
     E.rowOffset = 0;
     E.colOffset = 0;
     E.filename = NULL;
@@ -1063,22 +5644,543 @@ void initEditor() {
     E.statusMsgTime = 0;
     E.dirty = 0;
     E.syntax = NULL;
+    E.journal = NULL;
+    E.follow = NULL;
+    E.loadedBytes = 0;
+    E.loadedPartial = 0;
+    E.loader = NULL;
+    E.loadError = 0;
+    E.lineLens = NULL;
+    E.numLineLens = 0;
+    E.loadBuf = NULL;
+    E.loadBufLen = 0;
+    E.headless = 0;
+    E.hex = NULL;
+    E.forceText = 0;
+    E.saveSource = -1;
+    memset(&E.completion, 0, sizeof(E.completion));
+    E.completion.current = -1;
+    E.completion.cy = -1;
+    E.search.lastMatch = -1;
+    E.search.direction = 1;
+    E.search.savedHl = NULL;
+    E.quitTimes = QUIT_TIMES;
+    E.completing = 0;
+    E.noCopyFileRange = 0;
+    E.screenRows = 24;
+    E.screenCols = 80;
+}
+
+void initEditor() {
+    initEditorState();
     if (getWindowSize(&E.screenRows, &E.screenCols) == -1) die("getWindowSize"); // Get the window size
     E.screenRows -= 2; // Make room for the status bar
 }
 
+// Frees everything the current buffer owns
+void editorFreeBuffer() {
+    editorFollowStop();
+    editorWordsDropBulk(); // The worker may still be counting words straight out of E.loadBuf
+    for (int j = 0; j < E.numRows; j++) editorFreeRow(&E.row[j]);
+    free(E.loadBuf);
+    E.loadBuf = NULL;
+    E.loadBufLen = 0;
+    free(E.row);
+    free(E.filename);
+    free(E.lineLens);
+    free(E.offsets.tree);
+    memset(&E.offsets, 0, sizeof(E.offsets));
+    free(E.folds.folds);
+    memset(&E.folds, 0, sizeof(E.folds));
+    if (E.saveSource != -1) close(E.saveSource);
+    E.saveSource = -1;
+    E.compression = COMPRESS_NONE;
+    if (E.brackets) {
+      free(E.brackets->close);
+      free(E.brackets->open);
+      free(E.brackets->rows);
+      free(E.brackets->known);
+      free(E.brackets);
+    }
+    E.row = NULL;
+    E.numRows = 0;
+    E.rowCap = 0;
+    E.filename = NULL;
+    E.lineLens = NULL;
+    E.numLineLens = 0;
+    E.brackets = NULL;
+}
+
+/*** Batch mode ***/
+enum batchOp {
+    BATCH_GOTO,
+    BATCH_FIND,
+    BATCH_REPLACE,
+    BATCH_INSERT,
+    BATCH_DELETE_LINE,
+    BATCH_SAVE
+};
+
+struct batchCommand {
+    enum batchOp op;
+    int line;
+    char *text; // find/insert text, or the text replace looks for
+    int textLen;
+    char *with; // What replace puts in its place
+    int withLen;
+};
+
+struct batchJob {
+    struct batchCommand *commands;
+    int numCommands;
+    char **files;
+    int numFiles;
+    int nextFile; // Next file a worker should pick up, taken with an atomic add
+    pthread_mutex_t outputLock;
+    long long bytes; // Totals, under outputLock
+    int failed;
+};
+
+// Turns the \n, \t and \\ escapes in s into the chars they stand for, in place
+static int batchUnescape(char *s){
+    int len = 0;
+    for(int i = 0; s[i]; i++){
+        if(s[i] == '\\' && s[i + 1]){
+            i++;
+            s[len++] = s[i] == 'n' ? '\n' : s[i] == 't' ? '\t' : s[i];
+        }else{
+            s[len++] = s[i];
+        }
+    }
+    s[len] = '\0';
+    return len;
+}
+
+// Reads a script with one command per line:
+//   goto <line> | find <text> | replace /<old>/<new>/ | insert <text> | deleteline | save
+// Blank lines and lines starting with # are skipped. Returns -1 after printing what is wrong
+static int batchParseScript(const char *path, struct batchCommand **out){
+    FILE *fp = fopen(path, "r");
+    if(!fp){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct batchCommand *cmds = NULL;
+    int n = 0;
+    int lineNo = 0;
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLen;
+    while((lineLen = getline(&line, &lineCap, fp)) != -1){
+        lineNo++;
+        while(lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) line[--lineLen] = '\0';
+        char *p = line;
+        while(*p == ' ' || *p == '\t') p++;
+        if(*p == '\0' || *p == '#') continue;
+
+        char *arg = strchr(p, ' ');
+        if(arg) *arg++ = '\0';
+        else arg = "";
+
+        struct batchCommand c;
+        memset(&c, 0, sizeof(c));
+        int bad = 0;
+        if(!strcmp(p, "goto")){
+            c.op = BATCH_GOTO;
+            c.line = atoi(arg);
+            bad = c.line < 1;
+        }else if(!strcmp(p, "find") || !strcmp(p, "insert")){
+            c.op = p[0] == 'f' ? BATCH_FIND : BATCH_INSERT;
+            c.text = strdup(arg);
+            c.textLen = batchUnescape(c.text);
+            bad = c.textLen == 0;
+        }else if(!strcmp(p, "replace")){
+            // The first char is the delimiter, like sed: replace /old/new/ or replace |a/b|c/d|
+            char delim = arg[0];
+            char *mid = delim ? strchr(&arg[1], delim) : NULL;
+            char *end = mid ? strchr(&mid[1], delim) : NULL;
+            bad = !end || mid == &arg[1];
+            if(!bad){
+                *mid = '\0';
+                *end = '\0';
+                c.op = BATCH_REPLACE;
+                c.text = strdup(&arg[1]);
+                c.textLen = batchUnescape(c.text);
+                c.with = strdup(&mid[1]);
+                c.withLen = batchUnescape(c.with);
+            }
+        }else if(!strcmp(p, "deleteline")){
+            c.op = BATCH_DELETE_LINE;
+        }else if(!strcmp(p, "save")){
+            c.op = BATCH_SAVE;
+        }else{
+            bad = 1;
+        }
+
+        if(bad){
+            fprintf(stderr, "%s:%d: can't understand '%s %s'\n", path, lineNo, p, arg);
+            free(line);
+            fclose(fp);
+            return -1;
+        }
+        cmds = realloc(cmds, sizeof(*cmds) * (n + 1));
+        cmds[n++] = c;
+    }
+    free(line);
+    fclose(fp);
+    *out = cmds;
+    return n;
+}
+
+// Moves the cursor to the next occurrence of text after it, returns 0 if there is none
+static int batchFind(const char *text, int len){
+    for(int y = E.cy; y < E.numRows; y++){
+        erow *row = &E.row[y];
+        int from = y == E.cy ? E.cx + 1 : 0;
+        if(y == E.cy && E.cx >= row->size) continue;
+        char *match = memmem(&row->chars[from], row->size - from, text, len);
+        if(match){
+            E.cy = y;
+            E.cx = match - row->chars;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Replaces every occurrence in the buffer, returns how many there were. Only works within rows, a
+// replacement can't join or split lines. Each changed row is cut back to where it first differs and
+// the rest appended, through the row functions like any other edit
+static int batchReplace(struct batchCommand *c){
+    int count = 0;
+    for(int y = 0; y < E.numRows; y++){
+        erow *row = &E.row[y];
+        char *match = memmem(row->chars, row->size, c->text, c->textLen);
+        if(!match) continue;
+
+        struct abuf out = ABUF_INIT;
+        int first = match - row->chars; // Everything before it stays as it is
+        int from = 0;
+        while(match){
+            int at = match - row->chars;
+            abAppend(&out, &row->chars[from], at - from);
+            abAppend(&out, c->with, c->withLen);
+            from = at + c->textLen;
+            count++;
+            match = memmem(&row->chars[from], row->size - from, c->text, c->textLen);
+        }
+        abAppend(&out, &row->chars[from], row->size - from);
+
+        editorRowTruncate(row, first);
+        editorRowAppendString(row, &out.b[first], out.len - first);
+        free(out.b);
+    }
+    if(E.cy < E.numRows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    return count;
+}
+
+// Runs the script against the current buffer. Returns 0, or -1 with why in err
+static int batchRun(struct batchJob *job, char *err, int errSize){
+    for(int i = 0; i < job->numCommands; i++){
+        struct batchCommand *c = &job->commands[i];
+        switch(c->op){
+            case BATCH_GOTO:
+                E.cy = c->line - 1 < E.numRows ? c->line - 1 : E.numRows;
+                E.cx = 0;
+                break;
+            case BATCH_FIND:
+                batchFind(c->text, c->textLen); // A miss leaves the cursor where it is
+                break;
+            case BATCH_REPLACE:
+                batchReplace(c);
+                break;
+            case BATCH_INSERT:
+                for(int j = 0; j < c->textLen; j++){
+                    if(c->text[j] == '\n') editorInsertNewline();
+                    else editorInsertChar((unsigned char)c->text[j]);
+                }
+                break;
+            case BATCH_DELETE_LINE:
+                editorDeleteRow(E.cy);
+                if(E.cy > E.numRows) E.cy = E.numRows;
+                E.cx = 0;
+                break;
+            case BATCH_SAVE:
+                if(!E.dirty) break;
+                editorSave();
+                if(E.dirty){
+                    snprintf(err, errSize, "%s", E.statusMsg);
+                    return -1;
+                }
+                break;
+        }
+    }
+    return 0;
+}
+
+static void *batchWorker(void *arg){
+    struct batchJob *job = arg;
+    struct editorConfig *ed = calloc(1, sizeof(*ed));
+    currentEditor = ed;
+
+    int i;
+    while((i = __atomic_fetch_add(&job->nextFile, 1, __ATOMIC_RELAXED)) < job->numFiles){
+        char *file = job->files[i];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        initEditorState();
+        E.headless = 1;
+        char err[80] = "";
+        struct stat st;
+        int ok = stat(file, &st) == 0 && access(file, R_OK | W_OK) == 0;
+        if(!ok){
+            snprintf(err, sizeof(err), "%s", strerror(errno));
+        }else if(editorOpen(file) == -1){
+            ok = 0;
+            snprintf(err, sizeof(err), "%s", E.statusMsg);
+        }else{
+            ok = batchRun(job, err, sizeof(err)) == 0;
+        }
+        long long bytes = ok ? (long long)st.st_size : 0;
+        editorFreeBuffer();
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        pthread_mutex_lock(&job->outputLock);
+        if(ok) printf("%s: ok %.2f ms\n", file, ms);
+        else printf("%s: FAILED %s (%.2f ms)\n", file, err, ms);
+        job->bytes += bytes;
+        job->failed += !ok;
+        pthread_mutex_unlock(&job->outputLock);
+    }
+
+    free(ed);
+    return NULL;
+}
+
+// text-editor --batch script [-j threads] files...
+// Applies the script to every file with a pool of threads, each with its own buffer
+int editorBatchMain(int argc, char *argv[]){
+    char *script = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct batchJob job;
+    memset(&job, 0, sizeof(job));
+    job.files = malloc(sizeof(char *) * argc);
+
+    for(int i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "--batch") && i + 1 < argc) script = argv[++i];
+        else if(!strcmp(argv[i], "-j") && i + 1 < argc) threads = atoi(argv[++i]);
+        else job.files[job.numFiles++] = argv[i];
+    }
+    if(!script || job.numFiles == 0){
+        fprintf(stderr, "usage: %s --batch script [-j threads] files...\n", argv[0]);
+        return 2;
+    }
+    job.numCommands = batchParseScript(script, &job.commands);
+    if(job.numCommands < 0) return 2;
+    if(threads < 1) threads = 1;
+    if(threads > job.numFiles) threads = job.numFiles;
+    pthread_mutex_init(&job.outputLock, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    for(int i = 0; i < threads; i++)
+        if(pthread_create(&workers[i], NULL, batchWorker, &job) != 0) die("pthread_create");
+    for(int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d files (%d failed) in %.3f s with %d threads: %.1f files/s, %.1f MB/s\n",
+        job.numFiles, job.failed, secs, threads, job.numFiles / secs, job.bytes / secs / (1024.0 * 1024.0));
+
+    for(int i = 0; i < job.numCommands; i++){
+        free(job.commands[i].text);
+        free(job.commands[i].with);
+    }
+    free(job.commands);
+    free(job.files);
+    free(workers);
+    return job.failed ? 1 : 0;
+}
+
+#ifdef TEXT_EDITOR_BENCH
+/*** benchmarks ***/
+static double benchNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What editorRowCxToRx cost before checkpoints, for comparison
+static int benchScanCxToRx(erow *row, int cx){
+    int rx = 0;
+    for (int j = 0; j < cx; j++) {
+      if(row->chars[j] == '\t')
+        rx += (TAB_STOPS - 1) - (rx % TAB_STOPS);
+      rx++;
+    }
+    return rx;
+}
+
+// Cursor motion on a single multi-megabyte line with tabs, like a minified file
+static void benchLongLine(int lineLen){
+    char *line = malloc(lineLen);
+    for (int i = 0; i < lineLen; i++) line[i] = (i % 61 == 0) ? '\t' : 'a' + i % 26;
+    editorInsertRow(E.numRows, line, lineLen);
+    erow *row = &E.row[E.numRows - 1];
+    free(line);
+
+    int ops = 200000;
+    volatile int sink = 0;
+    unsigned int seed = 1;
+    double start = benchNow();
+    editorRowCxToRx(row, 0); // Build the checkpoints outside of the timing, like the first frame does
+    double build = benchNow() - start;
+
+    start = benchNow();
+    for (int i = 0; i < ops; i++) {
+      seed = seed * 1103515245 + 12345;
+      sink += editorRowCxToRx(row, seed % row->size);
+    }
+    double cxToRx = benchNow() - start;
+
+    start = benchNow();
+    for (int i = 0; i < ops; i++) {
+      seed = seed * 1103515245 + 12345;
+      sink += editorRowRxToCx(row, seed % row->rsize);
+    }
+    double rxToCx = benchNow() - start;
+
+    int scanOps = 200;
+    start = benchNow();
+    for (int i = 0; i < scanOps; i++) {
+      seed = seed * 1103515245 + 12345;
+      sink += benchScanCxToRx(row, seed % row->size);
+    }
+    double scan = benchNow() - start;
+
+    printf("long line %d bytes: checkpoint build %.2f ms, cx->rx %.1f ns/op, rx->cx %.1f ns/op, full scan cx->rx %.1f us/op\n",
+        lineLen, build * 1e3, cxToRx / ops * 1e9, rxToCx / ops * 1e9, scan / scanOps * 1e6);
+    (void)sink;
+}
+
+// editorUpdateRow over mostly-ASCII source lines, the common case the UTF-8 handling must not slow down
+static void benchUpdateRows(int numRows){
+    const char *lines[] = {
+        "    for (int j = 0; j < row->size; j++) total += row->chars[j];",
+        "\treturn editorRowCxToRx(&E.row[E.cy], E.cx); // tab indented",
+        "    const char *greeting = \"h\xc3\xa9llo \xe4\xb8\xad\xe6\x96\x87\";",
+    };
+    long long bytes = 0;
+    double start = benchNow();
+    for (int i = 0; i < numRows; i++) {
+      const char *line = lines[i % 20 == 0 ? 2 : i % 2];
+      editorInsertRow(E.numRows, (char *)line, strlen(line));
+      bytes += strlen(line);
+    }
+    double elapsed = benchNow() - start;
+    printf("update %d rows: %.1f ns/row, %.1f MB/s\n", numRows, elapsed / numRows * 1e9, bytes / elapsed / 1e6);
+}
+
+// Builds frames of a 300x100 terminal full of highlighted C, the work done for every key press
+static void benchDrawFrame(){
+    static const char *code[] = {
+      "    for (int i = 0; i < numRows; i++) { // Walk every row once",
+      "        if (row->hl[i] == HL_NUMBER && isdigit(c)) return 42 + 0x1f;",
+      "    char *msg = \"unterminated \\\"string\\\" with 3 numbers 1 2 3\";",
+      "  /* a block comment that runs past the right edge of the screen and keeps going */",
+      "\tswitch (kind) { case 1: break; default: continue; } while (x < 10) x++;",
+    };
+    free(E.filename);
+    E.filename = strdup("bench.c");
+    editorSelectSyntaxHighlight();
+    E.screenRows = 100;
+    E.screenCols = 300;
+    for (int i = 0; i < 200; i++) {
+      char line[400];
+      int len = 0;
+      for (int j = 0; j < 5; j++) len += snprintf(&line[len], sizeof(line) - len, "%s ", code[(i + j) % 5]);
+      editorInsertRow(E.numRows, line, len);
+    }
+
+    int frames = 2000;
+    long long bytes = 0;
+    double start = benchNow();
+    struct frame *f = editorRenderFrame();
+    for (int i = 0; i < frames; i++) {
+      struct abuf ab = ABUF_INIT;
+      E.rowOffset = i % 100;
+      frameReset(f);
+      editorDrawRows(f);
+      frameCloseRaw(f);
+      frameRender(f, &ab);
+      bytes += ab.len;
+      abFree(&ab);
+    }
+    frameFree(f);
+    double elapsed = benchNow() - start;
+    printf("draw %dx%d frame: %.1f us/frame, %lld bytes/frame\n", E.screenCols, E.screenRows, elapsed / frames * 1e6, bytes / frames);
+    E.rowOffset = 0;
+}
+
+int main(){
+    static struct editorConfig benchEditor;
+    currentEditor = &benchEditor;
+    initEditorState();
+    benchUpdateRows(1000000);
+    benchLongLine(8 * 1024 * 1024);
+    benchLongLine(50 * 1024 * 1024);
+    editorFreeBuffer();
+    benchDrawFrame();
+    return 0;
+}
+#else
 int main(int argc, char*argv[]){
+    // Before any thread starts: a zstd child or reader going away fails that write with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    for(int i = 1; i < argc; i++)
+        if(!strcmp(argv[i], "--batch")) return editorBatchMain(argc, argv);
+
+    static struct editorConfig mainEditor;
+    currentEditor = &mainEditor;
+
+    char *filename = NULL;
+    int follow = 0;
+    for(int i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "-f")) follow = 1;
+        else filename = argv[i];
+    }
+
+    // "-" or a pipe on stdin means the text comes in on stdin, so keys have to come from the terminal itself
+    int fromStdin = filename ? !strcmp(filename, "-") : !isatty(STDIN_FILENO);
+    E.ttyFd = STDIN_FILENO;
+    if(fromStdin){
+        E.ttyFd = open("/dev/tty", O_RDWR);
+        if(E.ttyFd == -1) die("open /dev/tty");
+    }
+
     enableRawMode();
     initEditor();
-    if(argc >= 2){
-        editorOpen(argv[1]);
-    }
+    editorWordsStart();
+    editorInputStart();
+    editorRenderStart();
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-T = follow | Ctrl-B = bracket | Ctrl-N = complete | Ctrl-G = goto | Ctrl-E = lines | Ctrl-K = fold | Ctrl-W = wrap | Ctrl-X = hex");
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    if(fromStdin){
+        editorOpenStream(STDIN_FILENO);
+    }else if(filename){
+        editorOpen(filename);
+        if(follow) editorFollowStart();
+    }
 
     while(1){
+        editorIdle(); // Pull in streamed rows between keys too, not only when the keyboard is quiet
         editorRefreshScreen();
         editorProcessKeypress();
     }
     return 0;
 }
+#endif